@@ -0,0 +1,144 @@
+#ifndef ASYNC_FILE_IO_HPP
+#define ASYNC_FILE_IO_HPP
+
+#include <atomic>			  //	std::atomic_bool
+#include <condition_variable> //	std::condition_variable
+#include <functional>		  //	std::function
+#include <memory>			  //	std::shared_ptr
+#include <mutex>			  //	std::mutex
+#include <thread>			  //	std::thread
+#include <vector>			  //	std::vector
+
+#include <sys/types.h>		  //	ssize_t, off_t
+#include <sys/uio.h>		  //	iovec
+
+#include "thread_pool.hpp"	  // levi::ThreadPool
+#include "waitable_queue.hpp" // levi::WaitableQueue
+
+namespace levi
+{
+	// Result of an async file operation. It is completed by running it as a
+	// pool task, so its callback runs on a pool worker, never on an I/O thread.
+	class IOFuture : public ThreadPool::ITask
+	{
+	public:
+		typedef std::function<void(ssize_t)> Callback;
+
+		explicit IOFuture(Callback callback_);
+		~IOFuture() = default;
+
+		IOFuture(const IOFuture &other_) = delete;
+		IOFuture(const IOFuture &&other_) = delete;
+		IOFuture &operator=(const IOFuture &other_) = delete;
+		IOFuture &operator=(const IOFuture &&other_) = delete;
+
+		void Execute() override;
+
+		// bytes transferred (0 for fsync), or -errno. Blocks until completed
+		ssize_t GetResult() const;
+		bool IsReady() const;
+
+		// for WhenAll/WhenAny: runs once completed, after the callback
+		void OnReady(std::function<void()> callback_);
+
+	private:
+		friend class AsyncFileIO;
+
+		Callback m_callback;
+		std::vector<std::function<void()>> m_on_ready;
+		ssize_t m_result;
+		bool m_res_is_ready;
+		mutable std::condition_variable m_cvar;
+		mutable std::mutex m_mtx;
+	};
+
+	// ReadAsync/WriteAsync/FsyncAsync batch submissions through io_uring when
+	// the kernel supports it, otherwise run them on a few blocking I/O threads.
+	// Completions are posted to the pool. Destroy before the pool it feeds.
+	class AsyncFileIO
+	{
+	public:
+		enum Backend
+		{
+			AUTO_BACKEND,	 // io_uring, blocking threads when unavailable
+			BLOCKING_BACKEND // always blocking threads
+		};
+
+		typedef std::shared_ptr<IOFuture> IOFuturePtr;
+
+		explicit AsyncFileIO(ThreadPool &pool_, std::size_t queueDepth_ = 256,
+							 std::size_t blockingThreads_ = 2, Backend backend_ = AUTO_BACKEND);
+		~AsyncFileIO() noexcept;
+
+		AsyncFileIO(const AsyncFileIO &other_) = delete;
+		AsyncFileIO(const AsyncFileIO &&other_) = delete;
+		AsyncFileIO &operator=(const AsyncFileIO &other_) = delete;
+		AsyncFileIO &operator=(const AsyncFileIO &&other_) = delete;
+
+		// buf_ must stay valid until the future completes
+		IOFuturePtr ReadAsync(int fd_, void *buf_, std::size_t len_, off_t offset_,
+							  IOFuture::Callback callback_ = nullptr,
+							  ThreadPool::Priority priority_ = ThreadPool::NORMAL);
+		IOFuturePtr WriteAsync(int fd_, const void *buf_, std::size_t len_, off_t offset_,
+							   IOFuture::Callback callback_ = nullptr,
+							   ThreadPool::Priority priority_ = ThreadPool::NORMAL);
+		IOFuturePtr FsyncAsync(int fd_, IOFuture::Callback callback_ = nullptr,
+							   ThreadPool::Priority priority_ = ThreadPool::NORMAL);
+
+		bool UsesIoUring() const;
+
+	private:
+		enum Opcode
+		{
+			READ_OP,
+			WRITE_OP,
+			FSYNC_OP
+		};
+
+		struct Request
+		{
+			Opcode opcode;
+			int fd;
+			void *buf;
+			std::size_t len;
+			off_t offset;
+			IOFuturePtr future;
+			ThreadPool::Priority priority;
+			iovec vec; // io_uring READV/WRITEV argument, lives until completion
+		};
+
+		struct Ring;
+
+		ThreadPool &m_pool;
+		std::unique_ptr<Ring> m_ring; // null when running on blocking threads
+
+		// io_uring: requests in flight, capped by the completion queue size.
+		// SQEs are published under m_submit_mutex; the submitter that finds no
+		// flush running enters for all of them (m_unsubmitted), the others
+		// return at once. A failed enter sets m_ring_error and fails requests
+		std::size_t m_inflight;
+		std::size_t m_max_inflight;
+		unsigned m_unsubmitted;
+		bool m_flushing;
+		int m_ring_error;
+		std::mutex m_submit_mutex;
+		std::condition_variable m_submit_cv;
+		std::atomic_bool m_stop;
+		std::thread m_reaper;
+
+		// blocking fallback, a null request stops a thread
+		WaitableQueue<Request *> m_blocking_queue;
+		std::vector<std::thread> m_blocking_threads;
+
+		IOFuturePtr Submit(Opcode opcode_, int fd_, void *buf_, std::size_t len_, off_t offset_,
+						   IOFuture::Callback callback_, ThreadPool::Priority priority_);
+		void SubmitToRing(Request *request_);
+		void FlushRing(std::unique_lock<std::mutex> &lock_, std::vector<Request *> &failed_);
+		void ReapCompletions();
+		void BlockingExec();
+		void Complete(Request *request_, ssize_t result_);
+	};
+
+} // levi
+
+#endif /* async_file_io.hpp */
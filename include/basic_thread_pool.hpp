@@ -0,0 +1,340 @@
+#ifndef BASIC_THREAD_POOL_HPP
+#define BASIC_THREAD_POOL_HPP
+
+#include <algorithm>		  //	std::push_heap, std::pop_heap
+#include <atomic>			  //	std::atomic_size_t
+#include <condition_variable> //	std::condition_variable
+#include <cstddef>			  //	std::size_t
+#include <cstdint>			  //	uint64_t
+#include <deque>			  //	std::deque
+#include <functional>		  //	std::function
+#include <memory>			  //	std::shared_ptr
+#include <mutex>			  //	std::mutex
+#include <thread>			  //	std::thread
+#include <utility>			  //	std::move
+#include <vector>			  //	std::vector
+
+#include "task_types.hpp"	  // levi::TaskTypes::ITask, levi::TaskTypes::Priority
+
+namespace levi
+{
+	// Building blocks of BasicThreadPool. All calls into a queue policy are
+	// made under the pool lock; wait policies get that lock to wait on.
+	namespace pool_policy
+	{
+		// task policies: what a task is and how a worker runs it
+
+		// any callable. A concrete functor or function pointer type is called
+		// directly, std::function costs one indirect call
+		template <typename F = std::function<void()>>
+		struct InlineTask
+		{
+			typedef F Task;
+
+			static void Run(Task &task_)
+			{
+				task_();
+			}
+		};
+
+		// the ITask hierarchy (ThreadPool::ITask), so existing tasks run unchanged
+		struct VirtualTask
+		{
+			typedef std::shared_ptr<TaskTypes::ITask> Task;
+
+			static void Run(Task &task_)
+			{
+				task_->Execute();
+			}
+		};
+
+		// queue policies, over the task policy's Task
+
+		// first in first out, the priority is ignored
+		template <typename Task>
+		class FifoQueue
+		{
+		public:
+			void Push(Task &&task_, TaskTypes::Priority)
+			{
+				m_tasks.push_back(std::move(task_));
+			}
+
+			void Pop(Task &out_)
+			{
+				out_ = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			bool Empty() const
+			{
+				return m_tasks.empty();
+			}
+
+		private:
+			std::deque<Task> m_tasks;
+		};
+
+		// highest Priority first, first in first out within a Priority
+		template <typename Task>
+		class PriorityQueue
+		{
+		public:
+			PriorityQueue() : m_next_seq(0) {}
+
+			void Push(Task &&task_, TaskTypes::Priority priority_)
+			{
+				m_heap.push_back(Entry{std::move(task_), priority_, m_next_seq++});
+				std::push_heap(m_heap.begin(), m_heap.end(), Compare());
+			}
+
+			void Pop(Task &out_)
+			{
+				std::pop_heap(m_heap.begin(), m_heap.end(), Compare());
+				out_ = std::move(m_heap.back().task);
+				m_heap.pop_back();
+			}
+
+			bool Empty() const
+			{
+				return m_heap.empty();
+			}
+
+		private:
+			struct Entry
+			{
+				Task task;
+				int priority;
+				uint64_t seq;
+			};
+
+			// "less" is the entry to run later
+			struct Compare
+			{
+				bool operator()(const Entry &e1, const Entry &e2) const
+				{
+					if (e1.priority != e2.priority)
+					{
+						return e1.priority < e2.priority;
+					}
+
+					return e1.seq > e2.seq;
+				}
+			};
+
+			std::vector<Entry> m_heap;
+			uint64_t m_next_seq;
+		};
+
+		// wait policies: how an idle worker waits for the queue
+
+		// blocks on a condition variable right away
+		class BlockingWait
+		{
+		public:
+			template <typename PREDICATE>
+			void Wait(std::unique_lock<std::mutex> &lock_, PREDICATE ready_)
+			{
+				m_cv.wait(lock_, ready_);
+			}
+
+			void NotifyOne()
+			{
+				m_cv.notify_one();
+			}
+
+			void NotifyAll()
+			{
+				m_cv.notify_all();
+			}
+
+		private:
+			std::condition_variable m_cv;
+		};
+
+		// re-polls SPINS times, yielding with the lock released, before it
+		// blocks. Trades idle CPU for wakeup latency, and spares producers the
+		// notify syscall while no worker sleeps
+		template <std::size_t SPINS = 64>
+		class SpinThenBlockWait
+		{
+		public:
+			SpinThenBlockWait() : m_sleepers(0) {}
+
+			template <typename PREDICATE>
+			void Wait(std::unique_lock<std::mutex> &lock_, PREDICATE ready_)
+			{
+				for (std::size_t i = 0; i < SPINS && false == ready_(); ++i)
+				{
+					lock_.unlock();
+					std::this_thread::yield();
+					lock_.lock();
+				}
+
+				// counted under the lock, a producer pushing after this sees it
+				++m_sleepers;
+				m_cv.wait(lock_, ready_);
+				--m_sleepers;
+			}
+
+			void NotifyOne()
+			{
+				if (0 != m_sleepers.load())
+				{
+					m_cv.notify_one();
+				}
+			}
+
+			void NotifyAll()
+			{
+				m_cv.notify_all();
+			}
+
+		private:
+			std::condition_variable m_cv;
+			std::atomic_size_t m_sleepers;
+		};
+	}
+
+	// Fixed-size pool assembled from policies at compile time, for hot paths
+	// that need none of ThreadPool's features. The worker loop is pop-and-run:
+	// no control tasks ride the queue, so no rank is checked per task, and
+	// with InlineTask over a concrete functor nothing is called virtually.
+	//
+	//	 typedef BasicThreadPool<pool_policy::FifoQueue, pool_policy::BlockingWait,
+	//							 pool_policy::InlineTask<void (*)()>> FastPool;
+	//
+	// No pause, resize, deadlines or reactor. The destructor runs every task
+	// queued so far, then joins the workers.
+	//
+	// ThreadPool is not an instantiation of this template and is not built
+	// on these policies. Its queue also orders control tasks (stop, pause,
+	// spawn, drain) and EDF deadlines, and is fed by the ingress shards and
+	// affinity slots; its wait mode (QUEUE_WAIT / REACTOR_WAIT) is chosen at
+	// run time. None of that fits QueuePolicy / WaitPolicy, so the two pools
+	// only share the Priority and ITask types of task_types.hpp (VirtualTask).
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	class BasicThreadPool
+	{
+	public:
+		typedef typename TaskPolicy::Task Task;
+
+		explicit BasicThreadPool(std::size_t threadsNum_);
+		~BasicThreadPool() noexcept;
+
+		BasicThreadPool(const BasicThreadPool &other_) = delete;
+		BasicThreadPool(const BasicThreadPool &&other_) = delete;
+		BasicThreadPool &operator=(const BasicThreadPool &other_) = delete;
+		BasicThreadPool &operator=(const BasicThreadPool &&other_) = delete;
+
+		// priority_ only orders tasks under a priority-aware QueuePolicy
+		void AddTask(Task task_, TaskTypes::Priority priority_ = TaskTypes::NORMAL);
+		std::size_t GetNumOfThreads() const;
+
+	private:
+		QueuePolicy<Task> m_queue;
+		WaitPolicy m_wait;
+		std::mutex m_mutex;
+		bool m_stopping;
+		std::vector<std::thread> m_workers;
+
+		bool NextTask(Task &task_);
+		void ThreadExec();
+		void Stop() noexcept;
+	};
+
+	// FIFO pool of plain callables
+	typedef BasicThreadPool<pool_policy::FifoQueue, pool_policy::BlockingWait, pool_policy::InlineTask<>>
+		FifoThreadPool;
+	// Priority-ordered pool of TaskTypes::ITasks
+	typedef BasicThreadPool<pool_policy::PriorityQueue, pool_policy::BlockingWait, pool_policy::VirtualTask>
+		PriorityThreadPool;
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::BasicThreadPool(std::size_t threadsNum_) :
+		m_stopping(false)
+	{
+		m_workers.reserve(threadsNum_);
+		try
+		{
+			for (std::size_t i = 0; i < threadsNum_; ++i)
+			{
+				m_workers.push_back(std::thread([this]() { ThreadExec(); }));
+			}
+		}
+		catch (...)
+		{
+			Stop();
+			throw;
+		}
+	}
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::~BasicThreadPool() noexcept
+	{
+		Stop();
+	}
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	void BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::AddTask(Task task_, TaskTypes::Priority priority_)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_queue.Push(std::move(task_), priority_);
+		}
+
+		m_wait.NotifyOne();
+	}
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	std::size_t BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::GetNumOfThreads() const
+	{
+		return m_workers.size();
+	}
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	bool BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::NextTask(Task &task_)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wait.Wait(lock, [this]() { return false == m_queue.Empty() || m_stopping; });
+
+		// stopping is only looked at once the queue ran dry
+		if (m_queue.Empty())
+		{
+			return false;
+		}
+		m_queue.Pop(task_);
+
+		return true;
+	}
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	void BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::ThreadExec()
+	{
+		Task task;
+		while (NextTask(task))
+		{
+			TaskPolicy::Run(task);
+			task = Task(); // release captures before waiting again
+		}
+	}
+
+	template <template <typename> class QueuePolicy, typename WaitPolicy, typename TaskPolicy>
+	void BasicThreadPool<QueuePolicy, WaitPolicy, TaskPolicy>::Stop() noexcept
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_wait.NotifyAll();
+
+		for (std::thread &worker : m_workers)
+		{
+			worker.join();
+		}
+		m_workers.clear();
+	}
+
+} // levi
+
+#endif /* basic_thread_pool.hpp */
@@ -0,0 +1,179 @@
+#ifndef BOUNDED_CHANNEL_HPP
+#define BOUNDED_CHANNEL_HPP
+
+#include <atomic>			  //	std::atomic_size_t
+#include <cstddef>			  //	std::size_t
+#include <new>				  //	placement new
+#include <type_traits>		  //	std::aligned_storage
+#include <utility>			  //	std::move
+
+namespace levi
+{
+	// Bounded lock-free multi-producer multi-consumer ring (Vyukov). Items are
+	// moved in and out, capacity is rounded up to a power of two.
+	template <class T>
+	class BoundedChannel
+	{
+	public:
+		explicit BoundedChannel(std::size_t capacity_);
+		~BoundedChannel();
+
+		BoundedChannel(const BoundedChannel &other_) = delete;
+		BoundedChannel(const BoundedChannel &&other_) = delete;
+		BoundedChannel &operator=(const BoundedChannel &other_) = delete;
+		BoundedChannel &operator=(const BoundedChannel &&other_) = delete;
+
+		bool TryPush(T &&data_);
+		bool TryPop(T &out_);
+		// true while no item is ready at the head. An item whose push has not
+		// completed yet counts as absent, its producer still sees it through
+		bool IsEmpty() const;
+		std::size_t Capacity() const;
+
+	private:
+		static const std::size_t CACHE_LINE = 64;
+
+		struct Cell
+		{
+			std::atomic_size_t sequence;
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+		};
+
+		Cell *const m_cells;
+		const std::size_t m_mask;
+
+		char m_pad0[CACHE_LINE];
+		std::atomic_size_t m_enqueue_pos;
+		char m_pad1[CACHE_LINE - sizeof(std::atomic_size_t)];
+		std::atomic_size_t m_dequeue_pos;
+		char m_pad2[CACHE_LINE - sizeof(std::atomic_size_t)];
+
+		static std::size_t RoundUp(std::size_t capacity_);
+	};
+
+	template <class T>
+	BoundedChannel<T>::BoundedChannel(std::size_t capacity_) : m_cells(new Cell[RoundUp(capacity_)]),
+															   m_mask(RoundUp(capacity_) - 1),
+															   m_enqueue_pos(0), m_dequeue_pos(0)
+	{
+		for (std::size_t i = 0; i <= m_mask; ++i)
+		{
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	template <class T>
+	BoundedChannel<T>::~BoundedChannel()
+	{
+		T leftover;
+		while (TryPop(leftover))
+		{
+			//drop
+		}
+
+		delete[] m_cells;
+	}
+
+	template <class T>
+	bool BoundedChannel<T>::TryPush(T &&data_)
+	{
+		std::size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		Cell *cell = nullptr;
+
+		while (true)
+		{
+			cell = &m_cells[pos & m_mask];
+			std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+
+			if (0 == diff)
+			{
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // full
+			}
+			else
+			{
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		new (&cell->storage) T(std::move(data_));
+		cell->sequence.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	template <class T>
+	bool BoundedChannel<T>::TryPop(T &out_)
+	{
+		std::size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		Cell *cell = nullptr;
+
+		while (true)
+		{
+			cell = &m_cells[pos & m_mask];
+			std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+
+			if (0 == diff)
+			{
+				if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // empty
+			}
+			else
+			{
+				pos = m_dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		T *data = reinterpret_cast<T *>(&cell->storage);
+		out_ = std::move(*data);
+		data->~T();
+		cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	template <class T>
+	bool BoundedChannel<T>::IsEmpty() const
+	{
+		std::size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		std::size_t sequence = m_cells[pos & m_mask].sequence.load(std::memory_order_acquire);
+
+		// a stale pos reads ahead of the head, that errs on the side of non-empty
+		return static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1) < 0;
+	}
+
+	template <class T>
+	std::size_t BoundedChannel<T>::Capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	template <class T>
+	std::size_t BoundedChannel<T>::RoundUp(std::size_t capacity_)
+	{
+		std::size_t size = 2;
+		while (size < capacity_)
+		{
+			size <<= 1;
+		}
+
+		return size;
+	}
+
+} // levi
+
+#endif /* bounded_channel.hpp */
@@ -0,0 +1,31 @@
+#ifndef CPU_QUOTA_HPP
+#define CPU_QUOTA_HPP
+
+#include <cstddef>			  //	std::size_t
+#include <string>			  //	std::string
+
+namespace levi
+{
+	// CPUs this process may run on, from sched_getaffinity.
+	// hardware_concurrency (at least 1) when the mask cannot be read
+	std::size_t AffinityCpus();
+
+	// CPU bandwidth granted by the cgroup, in CPUs (1.5 for a 150ms/100ms
+	// quota). Reads cgroup v2 cpu.max and the v1 cpu controller's
+	// cpu.cfs_quota_us / cpu.cfs_period_us of this process's cgroup and its
+	// ancestors, and keeps the tightest. 0 when no quota applies
+	double CgroupCpuQuota();
+
+	// CPUs the process can actually use: the cgroup quota capped by the
+	// affinity mask, unlike hardware_concurrency which sees the whole host
+	double AvailableCpus();
+
+	// "<quota> <period>" of a cgroup v2 cpu.max file, 0 for "max ..."
+	double ParseCpuMax(const std::string &cpuMax_);
+
+	// cgroup v1 cfs values, 0 for an unlimited (-1) quota
+	double CfsQuotaCpus(long long quota_, long long period_);
+
+} // levi
+
+#endif /* cpu_quota.hpp */
@@ -0,0 +1,536 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <atomic>			  //	std::atomic_size_t
+#include <condition_variable> //	std::condition_variable
+#include <cstdint>			  //	uint64_t
+#include <functional>		  //	std::function
+#include <map>				  //	std::map
+#include <memory>			  //	std::shared_ptr
+#include <mutex>			  //	std::mutex
+#include <vector>			  //	std::vector
+
+#include "thread_pool.hpp"	   // levi::ThreadPool
+#include "bounded_channel.hpp" // levi::BoundedChannel
+
+namespace levi
+{
+	// Streaming pipeline over a ThreadPool. Stages are linked by bounded
+	// lock-free channels and run as pool tasks that drain their input. A stage
+	// only pops an item after reserving a slot downstream, so a full stage
+	// stops its producers instead of blocking workers, and in-flight items
+	// never exceed the sum of channel capacities.
+	//
+	//	 auto pipe = PipelineBuilder<std::string>(pool, 64)
+	//	 				 .Then<Record>(Parse, 4)
+	//	 				 .Then<Blob>(Compress, 4, ORDERED)
+	//	 				 .Sink(Write, 1, SERIAL);
+	//	 pipe->Push(std::move(line));
+	//	 pipe->Close();
+	//	 pipe->Wait();
+	//
+	// Items must be default constructible and movable, and are never copied.
+	enum StageMode
+	{
+		PARALLEL, // up to parallelism_ items at once, output in completion order
+		SERIAL,	  // one item at a time
+		ORDERED	  // up to parallelism_ items at once, output in input order
+	};
+
+	template <typename In>
+	class Pipeline;
+
+	template <typename In, typename Tail>
+	class PipelineBuilder;
+
+	namespace pipeline_detail
+	{
+		class State;
+
+		// input side of a stage, what the upstream stage (or the source) feeds
+		template <typename In>
+		class StageInput
+		{
+		public:
+			explicit StageInput(std::size_t capacity_) : m_channel(capacity_), m_reserved(0), m_queued(0) {}
+			virtual ~StageInput() = default;
+
+			// claim room for one item, PushReserved must follow
+			bool Reserve()
+			{
+				std::size_t reserved = m_reserved.load();
+				while (reserved < m_channel.Capacity())
+				{
+					if (m_reserved.compare_exchange_weak(reserved, reserved + 1))
+					{
+						return true;
+					}
+				}
+
+				return false;
+			}
+
+			void Unreserve()
+			{
+				--m_reserved;
+			}
+
+			bool HasRoom() const
+			{
+				return m_reserved.load() < m_channel.Capacity();
+			}
+
+			void PushReserved(In &&item_)
+			{
+				m_channel.TryPush(std::move(item_)); // cannot fail, room was reserved
+				++m_queued;
+				Schedule();
+			}
+
+			void SetOnSpace(std::function<void()> onSpace_)
+			{
+				m_on_space = onSpace_;
+			}
+
+			virtual void Schedule() = 0;
+
+		protected:
+			bool PopInput(In &out_)
+			{
+				if (false == m_channel.TryPop(out_))
+				{
+					return false;
+				}
+
+				--m_queued;
+				--m_reserved;
+				m_on_space();
+
+				return true;
+			}
+
+			bool HasInput() const
+			{
+				return 0 != m_queued.load();
+			}
+
+		private:
+			BoundedChannel<In> m_channel;
+			std::atomic_size_t m_reserved; // queued items plus reserved slots
+			std::atomic_size_t m_queued;
+			std::function<void()> m_on_space;
+		};
+
+		// output side of a stage, linked to the next stage once it exists
+		template <typename Out>
+		class StageOutput
+		{
+		public:
+			virtual ~StageOutput() = default;
+			virtual void SetNext(StageInput<Out> *next_) = 0;
+		};
+
+		// shared by the pipeline and its in-flight drain tasks, owns the stages
+		class State : public std::enable_shared_from_this<State>
+		{
+		public:
+			State(ThreadPool &pool_, std::size_t capacity_, ThreadPool::Priority priority_) :
+				pool(pool_), capacity(capacity_), priority(priority_), pushed(0), sunk(0), waiting_producers(0), closed(false) {}
+
+			void OnSpace()
+			{
+				if (0 != waiting_producers.load())
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.notify_all();
+				}
+			}
+
+			void OnSunk()
+			{
+				if (++sunk == pushed.load() && closed)
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.notify_all();
+				}
+			}
+
+			ThreadPool &pool;
+			const std::size_t capacity;
+			const ThreadPool::Priority priority;
+
+			std::vector<std::shared_ptr<void>> stages;
+
+			std::atomic_size_t pushed;
+			std::atomic_size_t sunk;
+			std::atomic_size_t waiting_producers;
+			std::atomic_bool closed;
+			std::mutex mutex;
+			std::condition_variable cv;
+		};
+
+		template <typename In, typename Out>
+		class Stage;
+
+		// runs one stage until its input is empty or its output is full
+		template <typename StageType>
+		class DrainTask : public ThreadPool::ITask
+		{
+		public:
+			DrainTask(std::shared_ptr<State> state_, StageType *stage_) : m_state(state_), m_stage(stage_) {}
+
+			void Execute() override
+			{
+				m_stage->Drain();
+			}
+
+		private:
+			std::shared_ptr<State> m_state; // keeps the stage alive
+			StageType *m_stage;
+		};
+
+		// common scheduling: at most m_parallelism drain tasks per stage
+		template <typename In>
+		class StageBase : public StageInput<In>
+		{
+		public:
+			StageBase(State &state_, std::size_t parallelism_, StageMode mode_) :
+				StageInput<In>(state_.capacity), m_state(state_),
+				m_parallelism(SERIAL == mode_ ? 1 : (0 == parallelism_ ? 1 : parallelism_)),
+				m_mode(mode_), m_active(0), m_next_ticket(0) {}
+
+		protected:
+			template <typename StageType>
+			void ScheduleDrain(StageType *stage_, bool canRun_)
+			{
+				std::size_t active = m_active.load();
+				while (active < m_parallelism && this->HasInput() && canRun_)
+				{
+					if (m_active.compare_exchange_weak(active, active + 1))
+					{
+						m_state.pool.AddTask(std::make_shared<DrainTask<StageType>>(m_state.shared_from_this(), stage_),
+											 m_state.priority);
+						return;
+					}
+				}
+			}
+
+			// in ORDERED mode a ticket records the input order of each item
+			bool PopTicket(In &out_, uint64_t &ticket_)
+			{
+				if (ORDERED != m_mode)
+				{
+					return this->PopInput(out_);
+				}
+
+				std::unique_lock<std::mutex> lock(m_pop_mutex);
+				if (false == this->PopInput(out_))
+				{
+					return false;
+				}
+				ticket_ = m_next_ticket++;
+
+				return true;
+			}
+
+			State &m_state;
+			const std::size_t m_parallelism;
+			const StageMode m_mode;
+			std::atomic_size_t m_active;
+
+		private:
+			std::mutex m_pop_mutex;
+			uint64_t m_next_ticket;
+		};
+
+		template <typename In, typename Out>
+		class Stage : public StageBase<In>, public StageOutput<Out>
+		{
+		public:
+			Stage(State &state_, std::function<Out(In)> func_, std::size_t parallelism_, StageMode mode_) :
+				StageBase<In>(state_, parallelism_, mode_), m_func(func_), m_next(nullptr), m_next_emit(0) {}
+
+			void SetNext(StageInput<Out> *next_) override
+			{
+				m_next = next_;
+				m_next->SetOnSpace([this]() { Schedule(); });
+			}
+
+			void Schedule() override
+			{
+				this->ScheduleDrain(this, m_next->HasRoom());
+			}
+
+			void Drain()
+			{
+				while (m_next->Reserve())
+				{
+					In item;
+					uint64_t ticket = 0;
+					if (false == this->PopTicket(item, ticket))
+					{
+						m_next->Unreserve();
+						break;
+					}
+
+					Emit(ticket, m_func(std::move(item)));
+				}
+
+				--this->m_active;
+				Schedule(); // input or downstream room may have shown up meanwhile
+			}
+
+		private:
+			void Emit(uint64_t ticket_, Out &&out_)
+			{
+				if (ORDERED != this->m_mode)
+				{
+					m_next->PushReserved(std::move(out_));
+					return;
+				}
+
+				// only items already holding a downstream slot wait here, so the
+				// window is bounded by the parallelism and cannot deadlock
+				std::unique_lock<std::mutex> lock(m_order_mutex);
+				m_reorder[ticket_] = std::move(out_);
+				while (!m_reorder.empty() && m_reorder.begin()->first == m_next_emit)
+				{
+					m_next->PushReserved(std::move(m_reorder.begin()->second));
+					m_reorder.erase(m_reorder.begin());
+					++m_next_emit;
+				}
+			}
+
+			std::function<Out(In)> m_func;
+			StageInput<Out> *m_next;
+
+			std::mutex m_order_mutex;
+			std::map<uint64_t, Out> m_reorder;
+			uint64_t m_next_emit;
+		};
+
+		// last stage, consumes items
+		template <typename In>
+		class Stage<In, void> : public StageBase<In>
+		{
+		public:
+			Stage(State &state_, std::function<void(In)> func_, std::size_t parallelism_, StageMode mode_) :
+				StageBase<In>(state_, parallelism_, mode_), m_func(func_), m_next_emit(0), m_flushing(false) {}
+
+			void Schedule() override
+			{
+				this->ScheduleDrain(this, true);
+			}
+
+			void Drain()
+			{
+				In item;
+				uint64_t ticket = 0;
+				while (this->PopTicket(item, ticket))
+				{
+					if (ORDERED == this->m_mode)
+					{
+						Consume(ticket, std::move(item));
+					}
+					else
+					{
+						m_func(std::move(item));
+						this->m_state.OnSunk();
+					}
+				}
+
+				--this->m_active;
+				Schedule();
+			}
+
+		private:
+			// whoever fills the gap consumes the buffered run, the rest move on
+			void Consume(uint64_t ticket_, In &&item_)
+			{
+				std::unique_lock<std::mutex> lock(m_order_mutex);
+				m_reorder[ticket_] = std::move(item_);
+				if (m_flushing)
+				{
+					return;
+				}
+
+				m_flushing = true;
+				while (!m_reorder.empty() && m_reorder.begin()->first == m_next_emit)
+				{
+					In next = std::move(m_reorder.begin()->second);
+					m_reorder.erase(m_reorder.begin());
+					++m_next_emit;
+
+					lock.unlock();
+					m_func(std::move(next));
+					this->m_state.OnSunk();
+					lock.lock();
+				}
+				m_flushing = false;
+			}
+
+			std::function<void(In)> m_func;
+
+			std::mutex m_order_mutex;
+			std::map<uint64_t, In> m_reorder;
+			uint64_t m_next_emit;
+			bool m_flushing;
+		};
+
+		template <typename A, typename B>
+		void SetHead(StageInput<A> *&, StageInput<B> *)
+		{
+			//only the first stage becomes the head
+		}
+
+		template <typename A>
+		void SetHead(StageInput<A> *&head_, StageInput<A> *stage_)
+		{
+			head_ = stage_;
+		}
+
+	} // pipeline_detail
+
+
+	template <typename In>
+	class Pipeline
+	{
+	public:
+		~Pipeline()
+		{
+			Close();
+			Wait();
+		}
+
+		Pipeline(const Pipeline &other_) = delete;
+		Pipeline(const Pipeline &&other_) = delete;
+		Pipeline &operator=(const Pipeline &other_) = delete;
+		Pipeline &operator=(const Pipeline &&other_) = delete;
+
+		// blocks while the first stage's channel is full; do not call from a
+		// worker of the same pool, use TryPush there
+		void Push(In item_)
+		{
+			if (m_head->Reserve())
+			{
+				Feed(std::move(item_));
+				return;
+			}
+
+			++m_state->waiting_producers;
+			{
+				std::unique_lock<std::mutex> lock(m_state->mutex);
+				m_state->cv.wait(lock, [this]() { return m_head->Reserve(); });
+			}
+			--m_state->waiting_producers;
+
+			Feed(std::move(item_));
+		}
+
+		bool TryPush(In &item_)
+		{
+			if (false == m_head->Reserve())
+			{
+				return false;
+			}
+
+			Feed(std::move(item_));
+			return true;
+		}
+
+		// no more Push calls will follow
+		void Close()
+		{
+			std::unique_lock<std::mutex> lock(m_state->mutex);
+			m_state->closed = true;
+			m_state->cv.notify_all();
+		}
+
+		// until Close() was called and every pushed item reached the sink
+		void Wait()
+		{
+			std::unique_lock<std::mutex> lock(m_state->mutex);
+			m_state->cv.wait(lock, [this]() { return m_state->closed && m_state->sunk == m_state->pushed; });
+		}
+
+	private:
+		template <typename, typename>
+		friend class PipelineBuilder;
+
+		Pipeline(std::shared_ptr<pipeline_detail::State> state_, pipeline_detail::StageInput<In> *head_) :
+			m_state(state_), m_head(head_)
+		{
+			pipeline_detail::State *state = m_state.get();
+			m_head->SetOnSpace([state]() { state->OnSpace(); });
+		}
+
+		void Feed(In &&item_)
+		{
+			++m_state->pushed;
+			m_head->PushReserved(std::move(item_));
+		}
+
+		std::shared_ptr<pipeline_detail::State> m_state;
+		pipeline_detail::StageInput<In> *m_head;
+	};
+
+
+	template <typename In, typename Tail = In>
+	class PipelineBuilder
+	{
+	public:
+		// capacity_ bounds each stage's input channel
+		PipelineBuilder(ThreadPool &pool_, std::size_t capacity_, ThreadPool::Priority priority_ = ThreadPool::NORMAL) :
+			m_state(std::make_shared<pipeline_detail::State>(pool_, capacity_, priority_)), m_head(nullptr), m_tail(nullptr) {}
+
+		template <typename Out>
+		PipelineBuilder<In, Out> Then(std::function<Out(Tail)> func_, std::size_t parallelism_ = 1,
+									  StageMode mode_ = PARALLEL)
+		{
+			typedef pipeline_detail::Stage<Tail, Out> StageType;
+			StageType *stage = Add(std::make_shared<StageType>(*m_state, func_, parallelism_, mode_));
+
+			return PipelineBuilder<In, Out>(m_state, m_head, stage);
+		}
+
+		std::unique_ptr<Pipeline<In>> Sink(std::function<void(Tail)> func_, std::size_t parallelism_ = 1,
+										   StageMode mode_ = PARALLEL)
+		{
+			typedef pipeline_detail::Stage<Tail, void> StageType;
+			Add(std::make_shared<StageType>(*m_state, func_, parallelism_, mode_));
+
+			return std::unique_ptr<Pipeline<In>>(new Pipeline<In>(m_state, m_head));
+		}
+
+	private:
+		template <typename, typename>
+		friend class PipelineBuilder;
+
+		PipelineBuilder(std::shared_ptr<pipeline_detail::State> state_, pipeline_detail::StageInput<In> *head_,
+						pipeline_detail::StageOutput<Tail> *tail_) :
+			m_state(state_), m_head(head_), m_tail(tail_) {}
+
+		template <typename StageType>
+		StageType *Add(std::shared_ptr<StageType> stage_)
+		{
+			m_state->stages.push_back(stage_);
+			if (nullptr != m_tail)
+			{
+				m_tail->SetNext(stage_.get());
+			}
+			else
+			{
+				pipeline_detail::SetHead(m_head, static_cast<pipeline_detail::StageInput<Tail> *>(stage_.get()));
+			}
+
+			return stage_.get();
+		}
+
+		std::shared_ptr<pipeline_detail::State> m_state;
+		pipeline_detail::StageInput<In> *m_head;
+		pipeline_detail::StageOutput<Tail> *m_tail;
+	};
+
+} // levi
+
+#endif /* pipeline.hpp */
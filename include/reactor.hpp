@@ -0,0 +1,70 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <cstdint>			  //	uint32_t
+#include <functional>		  //	std::function
+#include <memory>			  //	std::shared_ptr
+#include <mutex>			  //	std::mutex
+#include <condition_variable> //	std::condition_variable
+#include <thread>			  //	std::thread::id
+#include <unordered_map>	  //	std::unordered_map
+
+namespace levi
+{
+	// epoll set shared by the pool's idle workers. A semaphore eventfd in the
+	// same set carries task-queue wakeups, one token per pushed task.
+	class Reactor
+	{
+	public:
+		struct Handler
+		{
+			int fd;
+			uint32_t events;
+			std::function<void(uint32_t)> callback;
+			bool run_inline;
+			int priority;
+		};
+
+		typedef std::shared_ptr<Handler> HandlerPtr;
+
+		Reactor();
+		~Reactor() noexcept;
+
+		Reactor(const Reactor &other_) = delete;
+		Reactor(const Reactor &&other_) = delete;
+		Reactor &operator=(const Reactor &other_) = delete;
+		Reactor &operator=(const Reactor &&other_) = delete;
+
+		void Watch(HandlerPtr handler_);
+		// Once Unwatch returns the fd's callback is not running and will not
+		// run again. Called from that callback itself it does not wait.
+		void Unwatch(int fd_);
+
+		// Runs handler_'s callback unless it was unwatched meanwhile. fd
+		// events are armed one-shot, so only one worker handles an fd at a
+		// time; it is rearmed once the callback returned.
+		void Run(const Handler &handler_, uint32_t revents_);
+
+		// wake count_ idle workers, one per newly pushed task
+		void Notify(uint64_t count_ = 1);
+
+		// Blocks until a wakeup token or an fd event arrives. Returns the
+		// ready handler, or nullptr when woken for the task queue.
+		HandlerPtr Wait(uint32_t &revents_);
+
+	private:
+		int m_epoll_fd;
+		int m_event_fd;
+
+		std::unordered_map<int, HandlerPtr> m_handlers;
+		// callbacks in flight and the thread running each, for Unwatch
+		std::unordered_map<const Handler *, std::thread::id> m_running;
+		std::condition_variable m_finished;
+		std::mutex m_mutex;
+
+		bool IsCurrent(const Handler &handler_) const;
+	};
+
+} // levi
+
+#endif /* reactor.hpp */
@@ -0,0 +1,109 @@
+#ifndef SHM_TASK_QUEUE_HPP
+#define SHM_TASK_QUEUE_HPP
+
+#include <atomic>			  //	std::atomic
+#include <chrono>			  //	std::chrono::milliseconds
+#include <cstddef>			  //	std::size_t
+#include <cstdint>			  //	uint32_t, uint64_t
+#include <functional>		  //	std::function
+#include <memory>			  //	std::unique_ptr
+#include <mutex>			  //	std::mutex
+#include <string>			  //	std::string
+#include <thread>			  //	std::thread
+#include <unordered_map>	  //	std::unordered_map
+
+#include "thread_pool.hpp"	  // levi::ThreadPool
+
+namespace levi
+{
+	// A job as it travels between processes: which handler runs it, and an
+	// inline payload of up to MAX_PAYLOAD bytes
+	struct ShmRecord
+	{
+		static const std::size_t MAX_PAYLOAD = 240;
+
+		uint32_t handler_id;
+		uint32_t length;
+		char payload[MAX_PAYLOAD];
+	};
+
+	// Bounded lock-free MPMC ring of ShmRecords in a POSIX shared-memory
+	// segment, so producer processes can feed a pool in another process.
+	// Idle consumers and blocked producers sleep on shared futexes.
+	class ShmTaskQueue
+	{
+	public:
+		// the creator owns the segment name and unlinks it when destroyed
+		static std::unique_ptr<ShmTaskQueue> Create(const std::string &name_, std::size_t capacity_);
+		static std::unique_ptr<ShmTaskQueue> Open(const std::string &name_);
+		~ShmTaskQueue() noexcept;
+
+		ShmTaskQueue(const ShmTaskQueue &other_) = delete;
+		ShmTaskQueue(const ShmTaskQueue &&other_) = delete;
+		ShmTaskQueue &operator=(const ShmTaskQueue &other_) = delete;
+		ShmTaskQueue &operator=(const ShmTaskQueue &&other_) = delete;
+
+		// false when the ring is full or length_ exceeds MAX_PAYLOAD
+		bool TryPush(uint32_t handlerId_, const void *payload_, std::size_t length_);
+		// waits while the ring is full
+		bool Push(uint32_t handlerId_, const void *payload_, std::size_t length_);
+
+		bool TryPop(ShmRecord &out_);
+		// false if nothing arrived within timeout_ or WakeConsumers was called
+		bool Pop(ShmRecord &out_, const std::chrono::milliseconds &timeout_);
+
+		void WakeConsumers();
+
+	private:
+		struct Header;
+		struct Cell;
+
+		ShmTaskQueue(const std::string &name_, void *mapping_, std::size_t size_, uint64_t mask_, bool owner_);
+
+		std::string m_name;
+		void *m_mapping;
+		std::size_t m_size;
+		uint64_t m_mask;
+		bool m_owner;
+		Header *m_header;
+		Cell *m_cells;
+	};
+
+	// Pumps records from a ShmTaskQueue into a ThreadPool, running the handler
+	// registered for each record's handler id on a pool worker
+	class ShmTaskServer
+	{
+	public:
+		typedef std::function<void(const char *, std::size_t)> Handler;
+
+		ShmTaskServer(ThreadPool &pool_, ShmTaskQueue &queue_,
+					  ThreadPool::Priority priority_ = ThreadPool::NORMAL);
+		~ShmTaskServer() noexcept;
+
+		ShmTaskServer(const ShmTaskServer &other_) = delete;
+		ShmTaskServer(const ShmTaskServer &&other_) = delete;
+		ShmTaskServer &operator=(const ShmTaskServer &other_) = delete;
+		ShmTaskServer &operator=(const ShmTaskServer &&other_) = delete;
+
+		void RegisterHandler(uint32_t handlerId_, Handler handler_);
+		// records with no registered handler are counted and dropped
+		std::size_t GetUnhandled() const;
+
+	private:
+		ThreadPool &m_pool;
+		ShmTaskQueue &m_queue;
+		const ThreadPool::Priority m_priority;
+
+		std::unordered_map<uint32_t, std::shared_ptr<Handler>> m_handlers;
+		mutable std::mutex m_mutex;
+		std::atomic_size_t m_unhandled;
+
+		std::atomic_bool m_stop;
+		std::thread m_pump;
+
+		void Pump();
+	};
+
+} // levi
+
+#endif /* shm_task_queue.hpp */
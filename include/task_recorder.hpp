@@ -0,0 +1,119 @@
+#ifndef TASK_RECORDER_HPP
+#define TASK_RECORDER_HPP
+
+#include <atomic>			  //	std::atomic_bool
+#include <chrono>			  //	std::chrono::steady_clock
+#include <cstdint>			  //	uint64_t, uint32_t
+#include <cstdio>			  //	FILE
+#include <mutex>			  //	std::mutex
+#include <string>			  //	std::string
+#include <vector>			  //	std::vector
+
+namespace levi
+{
+	// One recorded task, as Load returns it
+	struct TaskRecord
+	{
+		uint64_t submit_ns;	  // AddTask time, since recording started
+		uint64_t duration_ns; // time spent in Execute, 0 when it never ran
+		uint32_t producer;	  // submitting thread, numbered from 1 in order of first AddTask
+		uint8_t priority;	  // ThreadPool::Priority
+		uint8_t completed;	  // 0 when cancelled, dropped or still queued at StopRecording
+		uint8_t reserved[2];
+	};
+
+	// One entry of a recording file, after a TaskRecordHeader. A task is
+	// logged when it is added and again, by the same id, when it finishes
+	struct TaskLogEntry
+	{
+		enum Kind
+		{
+			SUBMIT,
+			COMPLETE
+		};
+
+		uint64_t id;	   // unique within one recording
+		uint64_t ns;	   // SUBMIT: AddTask time since recording started, COMPLETE: Execute duration
+		uint32_t producer; // SUBMIT only
+		uint8_t priority;  // SUBMIT only
+		uint8_t kind;	   // Kind
+		uint8_t reserved[2];
+	};
+
+	struct TaskRecordHeader
+	{
+		char magic[4]; // "TPRC"
+		uint32_t version;
+	};
+
+	// Log entries of one worker or producer group, flushed to the file in batches
+	class RecordBuffer
+	{
+	public:
+		RecordBuffer() = default;
+
+		RecordBuffer(const RecordBuffer &other_) = delete;
+		RecordBuffer(const RecordBuffer &&other_) = delete;
+		RecordBuffer &operator=(const RecordBuffer &other_) = delete;
+		RecordBuffer &operator=(const RecordBuffer &&other_) = delete;
+
+	private:
+		friend class TaskRecorder;
+
+		std::mutex m_mutex;
+		std::vector<TaskLogEntry> m_entries;
+	};
+
+	class TaskRecorder
+	{
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		static const uint32_t VERSION = 2;
+
+		TaskRecorder();
+		~TaskRecorder() noexcept;
+
+		TaskRecorder(const TaskRecorder &other_) = delete;
+		TaskRecorder(const TaskRecorder &&other_) = delete;
+		TaskRecorder &operator=(const TaskRecorder &other_) = delete;
+		TaskRecorder &operator=(const TaskRecorder &&other_) = delete;
+
+		bool Start(const std::string &path_);
+		// Stop drops later Appends, then flush every worker's RecordBuffer and
+		// Close, which also writes the buffered submits
+		void Stop();
+		void Close();
+
+		bool IsRecording() const
+		{
+			return m_recording.load(std::memory_order_acquire);
+		}
+
+		// logged by the adding thread, into a buffer shared by producer_ % SUBMIT_SHARDS
+		void AppendSubmit(uint64_t id_, Clock::time_point submitted_, uint32_t producer_, int priority_);
+		// logged by the worker that ran id_, into its own buffer
+		void AppendComplete(RecordBuffer &buffer_, uint64_t id_, Clock::duration duration_);
+		void Flush(RecordBuffer &buffer_);
+
+		// reads a whole recording and joins each task's submit and completion,
+		// in submit log order; false on a missing or foreign file
+		static bool Load(const std::string &path_, std::vector<TaskRecord> &out_);
+
+	private:
+		static const std::size_t FLUSH_RECORDS = 4096;
+		static const std::size_t SUBMIT_SHARDS = 16;
+
+		std::atomic_bool m_recording;
+		Clock::time_point m_start;
+		std::FILE *m_file;
+		std::mutex m_file_mutex;
+		RecordBuffer m_submits[SUBMIT_SHARDS];
+
+		void Append(RecordBuffer &buffer_, const TaskLogEntry &entry_);
+		void Write(const std::vector<TaskLogEntry> &entries_);
+	};
+
+} // levi
+
+#endif /* task_recorder.hpp */
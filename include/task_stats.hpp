@@ -0,0 +1,78 @@
+#ifndef TASK_STATS_HPP
+#define TASK_STATS_HPP
+
+#include <atomic>			  //	std::atomic
+#include <chrono>			  //	std::chrono::nanoseconds
+#include <cstddef>			  //	std::size_t
+#include <cstdint>			  //	int64_t
+#include <string>			  //	std::string
+#include <unordered_map>	  //	std::unordered_map
+
+namespace levi
+{
+	// Cost of one task type, summed over every task of that type that ran
+	struct TaskStats
+	{
+		TaskStats() : count(0), wall(0), cpu(0), queue_wait(0) {}
+
+		std::size_t count;
+		std::chrono::nanoseconds wall;		 // time spent in Execute
+		std::chrono::nanoseconds cpu;		 // thread CPU time spent in Execute, 0 unless measured
+		std::chrono::nanoseconds queue_wait; // from AddTask to the start of Execute
+	};
+
+	// Per-worker TaskStats, keyed by the tag pointer so the worker never
+	// hashes a string. Tags must have static storage duration (a literal or
+	// a typeid name); each is copied once, when first seen, so reading never
+	// touches it again. One writer at a time, the owning worker or Merge
+	// under the caller's lock, and Add takes no lock: readers load the
+	// counters as they are. Tags beyond MAX_TAGS share one "(other)" entry.
+	class TaskStatsTable
+	{
+	public:
+		static const std::size_t MAX_TAGS = 128;
+
+		TaskStatsTable();
+
+		TaskStatsTable(const TaskStatsTable &other_) = delete;
+		TaskStatsTable(const TaskStatsTable &&other_) = delete;
+		TaskStatsTable &operator=(const TaskStatsTable &other_) = delete;
+		TaskStatsTable &operator=(const TaskStatsTable &&other_) = delete;
+
+		// typeName_ marks a typeid name, demangled when read
+		void Add(const char *tag_, bool typeName_, std::chrono::nanoseconds wall_, std::chrono::nanoseconds cpu_,
+				 std::chrono::nanoseconds queueWait_);
+		// adds every entry of other_, for tables of retired workers
+		void Merge(const TaskStatsTable &other_);
+		// adds every entry to out_, under its tag text
+		void MergeInto(std::unordered_map<std::string, TaskStats> &out_) const;
+
+		// CPU time consumed by the calling thread so far
+		static std::chrono::nanoseconds ThreadCpuTime();
+
+	private:
+		struct Slot
+		{
+			Slot() : tag(nullptr), type_name(false), count(0), wall(0), cpu(0), queue_wait(0) {}
+
+			std::atomic<const char *> tag; // published last, nullptr while free
+			std::string text;
+			bool type_name;
+
+			std::atomic_size_t count;
+			std::atomic<int64_t> wall; // nanoseconds
+			std::atomic<int64_t> cpu;
+			std::atomic<int64_t> queue_wait;
+		};
+
+		Slot m_slots[MAX_TAGS];
+		Slot m_other;
+
+		// text_ is copied when a slot is claimed for tag_
+		Slot &Find(const char *tag_, bool typeName_, const char *text_);
+		void Bump(Slot &slot_, std::size_t count_, int64_t wall_, int64_t cpu_, int64_t queueWait_);
+	};
+
+} // levi
+
+#endif /* task_stats.hpp */
@@ -0,0 +1,44 @@
+#ifndef TASK_TYPES_HPP
+#define TASK_TYPES_HPP
+
+namespace levi
+{
+	// Task types shared by ThreadPool (which derives from this, so they read
+	// ThreadPool::Priority, ThreadPool::ITask) and BasicThreadPool, which
+	// includes only this header rather than the whole ThreadPool runtime
+	struct TaskTypes
+	{
+		enum Priority
+		{
+			LOW,
+			NORMAL,
+			HIGH
+		};
+
+		class ITask;
+	};
+
+	class TaskTypes::ITask
+	{
+	public:
+		ITask() = default;
+		virtual ~ITask() = default;
+
+    	ITask(const ITask&) = delete;
+		ITask(const ITask &&other_) = delete;
+    	ITask& operator=(const ITask&) = delete;
+    	ITask& operator=(ITask&&) = delete;
+		
+		virtual void Execute() = 0; 
+
+		// groups tasks in GetTaskStats, nullptr for the dynamic type name.
+		// Must have static storage duration, e.g. a string literal
+		virtual const char *GetTypeTag() const
+		{
+			return nullptr;
+		}
+	};
+
+} // levi
+
+#endif /* task_types.hpp */
@@ -7,87 +7,400 @@
 #include <unordered_map>	  // 	std::unordered_map
 #include <utility>			  //    std:: pair
 #include <atomic>			  //    std:atomic<boo>
+#include <chrono>			  //    std::chrono::steady_clock
+#include <functional>		  //    std::function
+#include <cstdint>			  //    uint32_t
+#include <string>			  //    std::string
+#include <vector>			  //    std::vector
+#include <thread>			  //    std::thread
 
 #include "worker_thread.hpp"
 #include "waitable_queue.hpp" // levi::WaitableQueue
 #include "priority_queue.hpp"
+#include "reactor.hpp"		  // levi::Reactor
+#include "task_recorder.hpp"  // levi::TaskRecorder
+#include "task_stats.hpp"	  // levi::TaskStats
+#include "task_types.hpp"	  // levi::TaskTypes
 
 
 
 namespace levi
 {
-
-	class ThreadPool
+	// The full-featured pool. BasicThreadPool (basic_thread_pool.hpp) is the
+	// compile-time configured alternative for hot paths needing none of this.
+	class ThreadPool : public TaskTypes
 	{
 	public:
-		enum Priority
+		// PRIORITY_MODE orders tasks by Priority (deadlines only break ties),
+		// EDF_MODE orders tasks by earliest deadline first (priority breaks ties)
+		enum SchedulingMode
+		{
+			PRIORITY_MODE,
+			EDF_MODE
+		};
+
+		// QUEUE_WAIT idles workers on a per-worker wake token (Parker),
+		// REACTOR_WAIT idles them in epoll_wait so Watch()ed fds are served too
+		enum WaitMode
+		{
+			QUEUE_WAIT,
+			REACTOR_WAIT
+		};
+
+		// how a ready fd's callback runs: on the worker that saw the event,
+		// or as a pool task at the watch priority
+		enum DispatchMode
+		{
+			DISPATCH_INLINE,
+			DISPATCH_TASK
+		};
+
+		// per task type accounting, see SetTaskStats
+		enum TaskStatsMode
+		{
+			STATS_OFF,
+			STATS_WALL, // count, Execute wall time and queue wait
+			STATS_CPU	// also thread CPU time, one more syscall pair per task
+		};
+
+		// SHUTDOWN_DRAIN runs every task queued so far before workers stop,
+		// SHUTDOWN_CANCEL stops workers once their running task returns and
+		// drops the rest
+		enum ShutdownMode
+		{
+			SHUTDOWN_DRAIN,
+			SHUTDOWN_CANCEL
+		};
+
+		// what Auto sizes a pool for
+		enum SizingPolicy
 		{
-			LOW,
-			NORMAL,
-			HIGH
+			CPU_BOUND, // a worker per usable CPU, rounded down so the quota is never exceeded
+			IO_BOUND   // IO_BOUND_WORKERS_PER_CPU per usable CPU, as they mostly wait
 		};
 
-		explicit ThreadPool(std::size_t threadsNum_);
+		static const std::size_t IO_BOUND_WORKERS_PER_CPU = 4;
+		static const std::size_t DEFAULT_AFFINITY_STEAL_THRESHOLD = 8;
+
+		typedef std::chrono::steady_clock Clock;
+		typedef Clock::time_point TimePoint;
+
+		// Returns once the first worker is started, the rest are spawned by the
+		// workers themselves. stackSize_ 0 keeps the system default stack size
+		explicit ThreadPool(std::size_t threadsNum_, SchedulingMode mode_ = PRIORITY_MODE, WaitMode wait_ = QUEUE_WAIT,
+							std::size_t stackSize_ = 0);
 		~ThreadPool() noexcept;
 		ThreadPool(const ThreadPool &other_) = delete;
 		ThreadPool(const ThreadPool &&other_) = delete;
 		ThreadPool &operator=(const ThreadPool &&other_) = delete;
 		ThreadPool &operator=(const ThreadPool &other_) = delete;
 
-		class ITask;
+		class BlockingScope;
+
+		// Identifies a worker-local context registered with RegisterWorkerContext.
+		// Bound to the registering pool, a worker of any other pool gets nullptr
+		template <typename T>
+		class ContextKey
+		{
+		public:
+			std::size_t Index() const { return m_index; }
+
+		private:
+			friend class ThreadPool;
+			ContextKey(uint64_t pool_, std::size_t index_) : m_pool(pool_), m_index(index_) {}
+
+			uint64_t m_pool;
+			std::size_t m_index;
+		};
 		
 
 		void Pause();
 		void Resume();
+		// Worker count for the CPUs this process may use: its cgroup CPU quota
+		// (v1 or v2) capped by its affinity mask, see cpu_quota.hpp. Unlike
+		// hardware_concurrency it sees a container's limit, not the host.
+		//	 ThreadPool pool(ThreadPool::Auto(ThreadPool::IO_BOUND));
+		static std::size_t Auto(SizingPolicy policy_ = CPU_BOUND);
+
+		// Re-evaluates Auto(policy_) every interval_ on a background thread and
+		// calls SetNumOfThreads whenever the result changes, so a changed quota
+		// or mask resizes the pool. Sizes set by hand stand until it changes.
+		// Safe to call from any thread; does nothing once the pool shuts down
+		void StartAutoSizing(SizingPolicy policy_, std::chrono::milliseconds interval_);
+		void StopAutoSizing();
+
+		// Neither growing nor shrinking waits for workers: new ones are spawned
+		// by pool tasks, retiring ones leave the pool on their own and are
+		// joined by a later SetNumOfThreads, Shutdown or the destructor
 		void SetNumOfThreads(std::size_t newThreadsNum_);
+		// live workers, including compensating ones
+		std::size_t GetNumOfThreads() const;
+		// Each producer thread submits into its own ingress shard (one lane per
+		// Priority) that workers drain into the task queue, so producers never
+		// share a lock. Priority holds across shards, but tasks of one Priority
+		// from different producers run in no particular order. Producers beyond
+		// MAX_SHARDS per pool, or with a full lane, use the task queue directly
 		void AddTask(std::shared_ptr<ITask> p_task_, Priority priority_ = NORMAL);
+		void AddTask(std::shared_ptr<ITask> p_task_, TimePoint deadline_, Priority priority_ = NORMAL);
+
+		// Data-locality hint: the task goes to the affinity slot of
+		// affinityKey_ modulo the slot count, and the worker owning that slot
+		// runs it, so tasks sharing a key share that worker's caches. The pool
+		// has one slot per worker it was constructed with; workers added later
+		// own none. Idle workers steal from a slot only once it holds more than
+		// the steal threshold, or after its worker retired. A slot's tasks
+		// still yield to higher ranked tasks of the shared queue
+		void AddTask(std::shared_ptr<ITask> p_task_, Priority priority_, std::size_t affinityKey_);
+		void SetAffinityStealThreshold(std::size_t queued_);
+
+		// Tasks whose deadline passed before execution are dropped, or handed
+		// to handler_ (on the worker thread) instead of being executed
+		void SetDeadlineMissHandler(std::function<void(std::shared_ptr<ITask>)> handler_);
+		std::size_t GetDeadlineMisses() const;
+		std::unordered_map<std::thread::id, std::size_t> GetDeadlineMissesPerWorker() const;
+
+		// REACTOR_WAIT only. callback_ gets the ready epoll events of fd_; the fd
+		// is served by one worker at a time and rearmed after callback_ returns
+		void Watch(int fd_, uint32_t events_, std::function<void(uint32_t)> callback_,
+				   DispatchMode dispatch_ = DISPATCH_INLINE, Priority priority_ = NORMAL);
+		// Waits for a running callback of fd_, unless called from it; a
+		// DISPATCH_TASK callback still queued is dropped
+		void Unwatch(int fd_);
+
+		// Logs every task added while recording (submit time, priority,
+		// producer thread) to path_ when it is added, and its Execute duration
+		// when it finishes, for tools/replay
+		bool StartRecording(const std::string &path_);
+		void StopRecording();
+
+		// Opt-in per task type accounting, off by default. Types are
+		// ITask::GetTypeTag, or the dynamic type name when a task has no tag.
+		// Workers keep their own tables, GetTaskStats merges them (retired
+		// workers included)
+		void SetTaskStats(TaskStatsMode mode_);
+		std::unordered_map<std::string, TaskStats> GetTaskStats() const;
+
+		// Stops every worker (resuming a paused pool first) and waits up to
+		// timeout_ for them to leave, false if some task outlived timeout_.
+		// Tasks added afterwards never run. The destructor cancels and waits
+		// for good if Shutdown was not called
+		bool Shutdown(ShutdownMode mode_, std::chrono::milliseconds timeout_);
+
+		// cap on extra workers spawned for BlockingScopes, defaults to threadsNum_
+		void SetMaxCompensatingThreads(std::size_t max_);
+
+		// Every worker lazily builds its own T with factory_ on first use, and
+		// destroys it when the worker retires (SetNumOfThreads or destruction)
+		template <typename T>
+		ContextKey<T> RegisterWorkerContext(std::function<T *()> factory_);
+
+		// Worker-local context of the calling worker, for use inside
+		// ITask::Execute. Returns nullptr when not called from a pool worker
+		template <typename T>
+		static T *GetWorkerContext(ContextKey<T> key_);
+
+		// Safe point for a long-running task. If tasks of a higher Priority than
+		// the calling one are queued, runs them inline on this stack, then
+		// returns true. Otherwise costs a relaxed atomic load, plus a look at
+		// each ingress shard's lanes above the caller's Priority. Returns false
+		// outside a pool worker; in EDF_MODE all tasks share a rank, so it
+		// never yields.
+		static bool YieldIfNeeded();
+
+		static const std::size_t MAX_SHARDS = 128;
+		static const std::size_t SHARD_LANE_CAPACITY = 256;
 
 	private:
-		class KillThreadTask;
 		class StopThreadTask;
+		class SpawnThreadTask;
+		struct IngressShard;
+		struct AffinitySlot;
+		struct Parker;
+
+		// QUEUE_WAIT workers past this many poll for work instead of parking
+		static const std::size_t MAX_PARKERS = 1024;
+		static const std::size_t CACHE_LINE = 64;
 
 		typedef std::shared_ptr<ITask> ITaskPtr;
-		typedef std::pair<ITaskPtr, int> TaskPriorityPair;
+
+		struct TaskEntry
+		{
+			TaskEntry();
+			TaskEntry(ITaskPtr task_, int rank_, int priority_, TimePoint deadline_ = TimePoint::max());
+
+			ITaskPtr task;
+			int rank;			// queue order, control tasks rank above every user task
+			int priority;		// the Priority the task was added with
+			TimePoint deadline; // TimePoint::max() when the task has no deadline
+			TimePoint enqueued; // stamped only while recording or accounting
+			uint64_t record_id; // recording log id, 0 when not recorded
+		};
+
 		std::atomic_bool m_is_pause;
+		const SchedulingMode m_mode;
+		std::unique_ptr<Reactor> m_reactor; // null in QUEUE_WAIT
 
 
-		const int KILL_PRIORITY = 5;
+		const int DRAIN_PRIORITY = -1; // stop task of SHUTDOWN_DRAIN, below every user task
 		const int STOP_PRIORITY = 6;
 		const int PAUSE_PRIORITY = 7;
+		const int SPAWN_PRIORITY = 8;
 
 		class CompareFunctor
 		{
 		public:
-			bool operator()(const TaskPriorityPair &p1, TaskPriorityPair &p2) const;
+			bool operator()(const TaskEntry &e1, const TaskEntry &e2) const;
 		};
 
 		std::atomic_size_t m_working_thread_size;
 
-		WaitableQueue<TaskPriorityPair, PQWrapper<TaskPriorityPair, std::vector<TaskPriorityPair>, CompareFunctor>> m_tasksQueue;
-		std::unordered_map<std::thread::id, std::shared_ptr<WorkerThread>> m_map;
-		WaitableQueue<std::thread::id> m_wq_threads_id;
+		// [r]: user tasks in the task queue and affinity slots ranked above
+		// rank r, for YieldIfNeeded. Tasks still in ingress shards are not
+		// counted, producers never touch these; drains count them in batches
+		char m_queued_pad1[CACHE_LINE];
+		std::atomic_size_t m_queued_above[HIGH];
+		// [r]: user tasks ever counted above rank r, tells YieldIfNeeded whether
+		// any arrived since it last found none it could take
+		std::atomic_size_t m_pushed_above[HIGH];
+		char m_queued_pad2[CACHE_LINE];
+
+		typedef WaitableQueue<TaskEntry, PQWrapper<TaskEntry, std::vector<TaskEntry>, CompareFunctor>> TaskQueue;
+		TaskQueue m_tasksQueue;
+
+		// producer ingress, shards [0, m_shard_count) are published and stay in
+		// place. Producers find theirs through a thread-local cache keyed by
+		// m_id (an address could be reused by a later pool), which shares
+		// ownership; a shard given up by its producer is reused by the next
+		const uint64_t m_id;
+		std::shared_ptr<IngressShard> m_shards[MAX_SHARDS];
+		std::atomic_size_t m_shard_count;
+		std::mutex m_shard_mutex;
+		// workers about to block for work, producers wake one after filling a shard
+		std::atomic_size_t m_idle;
+		// QUEUE_WAIT workers park on their own token, so waking one takes no
+		// shared lock. Parkers [0, m_parker_count) are published, stay in place
+		// and are reused by later workers, like the shards
+		std::unique_ptr<Parker> m_parkers[MAX_PARKERS];
+		std::atomic_size_t m_parker_count;
+		std::mutex m_parker_mutex;
+		// the calling worker's, null past MAX_PARKERS and in REACTOR_WAIT
+		static thread_local Parker *tls_parker;
+
+		// affinity slots, fixed at construction. Ownership changes under m_slot_mutex
+		std::vector<std::unique_ptr<AffinitySlot>> m_slots;
+		std::mutex m_slot_mutex;
+		std::atomic_size_t m_steal_threshold;
+		const std::size_t m_stack_size;
+		std::unordered_map<WorkerThread *, std::shared_ptr<WorkerThread>> m_map;
+		// workers that left m_map but are not joined yet
+		std::vector<std::shared_ptr<WorkerThread>> m_retired;
+		// workers promised by queued SpawnThreadTasks
+		std::size_t m_pending_spawns;
+		mutable std::mutex m_map_mutex;
+		std::condition_variable m_retire_cv;
+		std::atomic_size_t m_retired_deadline_misses;
 
 		std::mutex m_mutex;
 		std::condition_variable m_cv;
 
-		void StopThreads(size_t num_of_threads);
-		void ThreadExec();
+		TaskRecorder m_recorder;
+
+		// StartAutoSizing's thread, and the lock serializing it with SetNumOfThreads.
+		// m_auto_control_mutex serializes Start/StopAutoSizing callers
+		std::thread m_auto_sizer;
+		bool m_auto_sizing;
+		std::mutex m_auto_control_mutex;
+		std::mutex m_auto_mutex;
+		std::condition_variable m_auto_cv;
+		std::mutex m_resize_mutex;
+
+		std::atomic_int m_task_stats_mode;
+		TaskStatsTable m_retired_task_stats;
+
+		// workers inside a BlockingScope, and the extra workers covering them
+		std::size_t m_blocked;
+		std::size_t m_compensating;
+		std::size_t m_max_compensating;
+		bool m_shutting_down;
+		std::mutex m_blocking_mutex;
+
+		void EnterBlocking();
+		void ExitBlocking();
+
+		std::function<void(ITaskPtr)> m_deadline_miss_handler;
+		std::mutex m_handler_mutex;
+
+		std::vector<std::function<std::shared_ptr<void>()>> m_context_factories;
+		std::mutex m_context_mutex;
+
+		std::size_t RegisterContextFactory(std::function<std::shared_ptr<void>()> factory_);
+		static void *GetContext(uint64_t pool_, std::size_t index_);
+
+		void PushTask(const TaskEntry &entry_);
+		void NextTask(TaskEntry &entry_);
+		void PopTask(TaskEntry &entry_);
+		IngressShard *LocalShard();
+		// lanes ranked above above_, every lane by default
+		bool HasIngress(int above_ = LOW - 1) const;
+		bool DrainIngress();
+		// batch_ holds tasks of rank_ only
+		std::size_t PublishIngress(std::vector<TaskEntry> &batch_, int rank_);
+		void WakeIdle(std::size_t count_ = 1);
+		TaskEntry UserEntry(ITaskPtr task_, TimePoint deadline_, Priority priority_);
+		void ClaimParker();
+		void ReleaseParker();
+		void ClaimSlot();
+		void ReleaseSlot();
+		bool IsStealable(std::size_t slot_, std::size_t threshold_) const;
+		bool PopOwnSlot(TaskEntry &entry_);
+		bool PopAffinity(TaskEntry &entry_, std::size_t threshold_);
+		bool HasAffinityWork() const;
+		void WakeAffinity(std::size_t slot_);
+		void CountQueued(int rank_, int delta_);
+		void StopThreads(size_t num_of_threads, int rank_);
+		void SpawnThreads(size_t num_of_threads);
+		void SpawnThreadsAsync(size_t num_of_threads);
+		void Retire(WorkerThread &worker_);
+		void ReapRetired();
+		// stops and joins m_auto_sizer, callers hold m_auto_control_mutex
+		void JoinAutoSizer();
+		bool StopAll(int rank_);
+		bool IsExpired(const TaskEntry &entry_, WorkerThread &worker_);
+		void RunTask(const TaskEntry &entry_, WorkerThread &worker_);
+		void ThreadExec(WorkerThread &worker_);
 	}; // ThreadPool
 	
-	class ThreadPool::ITask
+	// Marks a blocking call (legacy library, DNS, file lock) inside a task. While
+	// it is alive the pool runs one compensating worker in its place, up to
+	// SetMaxCompensatingThreads, and retires it once the scope ends. Does
+	// nothing outside a pool worker; nested scopes count once.
+	class ThreadPool::BlockingScope
 	{
 	public:
-		ITask() = default;
-		virtual ~ITask() = default;
+		BlockingScope();
+		~BlockingScope() noexcept;
 
-    	ITask(const ITask&) = delete;
-		ITask(const ITask &&other_) = delete;
-    	ITask& operator=(const ITask&) = delete;
-    	ITask& operator=(ITask&&) = delete;
-		
-		virtual void Execute() = 0; 
+		BlockingScope(const BlockingScope &other_) = delete;
+		BlockingScope(const BlockingScope &&other_) = delete;
+		BlockingScope &operator=(const BlockingScope &other_) = delete;
+		BlockingScope &operator=(const BlockingScope &&other_) = delete;
+
+	private:
+		ThreadPool *m_pool;
 	};
 
+	template <typename T>
+	ThreadPool::ContextKey<T> ThreadPool::RegisterWorkerContext(std::function<T *()> factory_)
+	{
+		// shared_ptr<void> built from a T* keeps T's deleter
+		return ContextKey<T>(m_id, RegisterContextFactory([factory_]() { return std::shared_ptr<void>(factory_()); }));
+	}
+
+	template <typename T>
+	T *ThreadPool::GetWorkerContext(ContextKey<T> key_)
+	{
+		return static_cast<T *>(GetContext(key_.m_pool, key_.m_index));
+	}
 
 	class ThreadPool::StopThreadTask : public ThreadPool::ITask
 	{
@@ -105,22 +418,25 @@ namespace levi
 	};
 
 
-	class ThreadPool::KillThreadTask : public ThreadPool::ITask
+	// spawns one worker and hands the rest of its share to two more spawn
+	// tasks, so workers start in parallel instead of one after another
+	class ThreadPool::SpawnThreadTask : public ThreadPool::ITask
 	{
 	public:
-		KillThreadTask(ThreadPool *pool);
-		~KillThreadTask() = default;
+		SpawnThreadTask(ThreadPool *pool, std::size_t count);
+		~SpawnThreadTask() = default;
 		void Execute();
 
-		KillThreadTask(const KillThreadTask &other_) = delete;
-		KillThreadTask(const KillThreadTask &&other_) = delete;
-		KillThreadTask &operator=(const KillThreadTask &&other_) = delete;
-		KillThreadTask &operator=(const KillThreadTask &other_) = delete;
-	
+		SpawnThreadTask(const SpawnThreadTask &other_) = delete;
+		SpawnThreadTask(const SpawnThreadTask &&other_) = delete;
+		SpawnThreadTask &operator=(const SpawnThreadTask &&other_) = delete;
+		SpawnThreadTask &operator=(const SpawnThreadTask &other_) = delete;
 	private:
 		ThreadPool *m_pool;
+		std::size_t m_count;
 	};
 
+
 	template <typename ReturnType, typename... Args>
 	class FutureTask : public ThreadPool::ITask
 	{
@@ -132,8 +448,19 @@ namespace levi
 		void Execute() override
 		{
 			m_result = m_func();
-			m_res_is_ready = true;
-			m_cvar.notify_one();
+
+			std::vector<std::function<void()>> callbacks;
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				m_res_is_ready = true;
+				callbacks.swap(m_callbacks);
+			}
+			m_cvar.notify_all();
+
+			for (const std::function<void()> &callback : callbacks)
+			{
+				callback();
+			}
 		}
 
 		ReturnType GetResult() const
@@ -143,6 +470,27 @@ namespace levi
 			return m_result;
 		}
 
+		bool IsReady() const
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			return m_res_is_ready;
+		}
+
+		// callback_ runs once the result is ready: right away if it already
+		// is, otherwise on the worker that executed the task
+		void OnReady(std::function<void()> callback_)
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			if (false == m_res_is_ready)
+			{
+				m_callbacks.push_back(callback_);
+				return;
+			}
+			lock.unlock();
+
+			callback_();
+		}
+
 		FutureTask(const FutureTask &other_) = delete;
 		FutureTask(const FutureTask &&other_) = delete;
 		FutureTask &operator=(const FutureTask &&other_) = delete;
@@ -152,6 +500,7 @@ namespace levi
 		std::function<ReturnType(void)> m_func;
 		ReturnType m_result;
 		bool m_res_is_ready;
+		std::vector<std::function<void()>> m_callbacks;
 		mutable std::condition_variable m_cvar;
 		mutable std::mutex m_mtx;
 	};
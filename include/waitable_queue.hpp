@@ -4,6 +4,8 @@
 #include <condition_variable>     // std::condition_variable
 #include <mutex>                  // std::timed_mutex
 #include <queue>                  // std::queue
+#include <iostream>               // std::cout
+#include <vector>                 // std::vector
 
 namespace levi
 {
@@ -22,8 +24,14 @@ public:
 
 
 	void Push(const T& data_);
+	// pushes every item of data_ under one lock, then clears it
+	void PushAll(std::vector<T>& data_);
 	void Pop(T& out_);
 	bool Pop(T& out_, const std::chrono::milliseconds& timeout_);
+	bool TryPop(T& out_);
+	// pops the front only if pred_(front) holds
+	template<class PREDICATE>
+	bool TryPopIf(T& out_, PREDICATE pred_);
 	bool IsEmpty() const;
 
 private:
@@ -44,6 +52,30 @@ void WaitableQueue<T, CONTAINER>::Push(const T& data_)
     m_cv.notify_one();
 }
 
+template<class T, class CONTAINER>
+void WaitableQueue<T, CONTAINER>::PushAll(std::vector<T>& data_)
+{
+    std::size_t size = data_.size();
+    {
+    	std::unique_lock<std::timed_mutex> lock(m_mutex);
+
+		for (T& data : data_)
+		{
+			m_queue.push(data);
+		}
+    }
+    data_.clear();
+
+    if (1 < size)
+    {
+    	m_cv.notify_all();
+    }
+    else
+    {
+    	m_cv.notify_one();
+    }
+}
+
 template<class T, class CONTAINER>
 void WaitableQueue<T, CONTAINER>::Pop(T& out) 
 {
@@ -86,6 +118,41 @@ bool WaitableQueue<T, CONTAINER>::Pop(T& out_, const std::chrono::milliseconds&
 }
 
 
+template<class T, class CONTAINER>
+bool WaitableQueue<T, CONTAINER>::TryPop(T& out_)
+{
+	std::unique_lock<std::timed_mutex> lock(m_mutex);
+
+	if (m_queue.empty())
+	{
+		return false;
+	}
+
+	out_ = m_queue.front();
+	m_queue.pop();
+
+	return true;
+}
+
+
+template<class T, class CONTAINER>
+template<class PREDICATE>
+bool WaitableQueue<T, CONTAINER>::TryPopIf(T& out_, PREDICATE pred_)
+{
+	std::unique_lock<std::timed_mutex> lock(m_mutex);
+
+	if (m_queue.empty() || false == pred_(m_queue.front()))
+	{
+		return false;
+	}
+
+	out_ = m_queue.front();
+	m_queue.pop();
+
+	return true;
+}
+
+
 template<class T, class CONTAINER>
 bool WaitableQueue<T, CONTAINER>::IsEmpty() const
 {
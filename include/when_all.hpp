@@ -0,0 +1,252 @@
+#ifndef WHEN_ALL_HPP
+#define WHEN_ALL_HPP
+
+#include <atomic>			  //	std::atomic_size_t
+#include <condition_variable> //	std::condition_variable
+#include <cstddef>			  //	std::size_t
+#include <functional>		  //	std::function
+#include <memory>			  //	std::shared_ptr
+#include <mutex>			  //	std::mutex
+#include <thread>			  //	std::thread::id
+#include <vector>			  //	std::vector
+
+#include "thread_pool.hpp"	  // levi::ThreadPool
+
+namespace levi
+{
+	namespace when_detail
+	{
+		class WhenState;
+	}
+
+	// Completion of a WhenAll/WhenAny. Like IOFuture it is completed by running
+	// it as a pool task, so OnReady continuations run on a pool worker at the
+	// priority given to the combinator, and no thread ever blocks waiting for
+	// the children.
+	//
+	//	 auto all = WhenAll(pool, ThreadPool::HIGH, parse, load);
+	//	 all->OnReady([=]() { Merge(parse->GetResult(), load->GetResult()); });
+	//
+	// Children are any FutureTask, IOFuture or CombinedFuture, or anything else
+	// with an OnReady(std::function<void()>).
+	class CombinedFuture : public ThreadPool::ITask
+	{
+	public:
+		CombinedFuture() : m_res_is_ready(false), m_continued(false), m_index(0) {}
+		~CombinedFuture() = default;
+
+		CombinedFuture(const CombinedFuture &other_) = delete;
+		CombinedFuture(const CombinedFuture &&other_) = delete;
+		CombinedFuture &operator=(const CombinedFuture &other_) = delete;
+		CombinedFuture &operator=(const CombinedFuture &&other_) = delete;
+
+		void Execute() override
+		{
+			std::vector<std::function<void()>> callbacks;
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				m_res_is_ready = true;
+				m_runner = std::this_thread::get_id();
+				callbacks.swap(m_callbacks);
+			}
+			m_cvar.notify_all();
+
+			for (const std::function<void()> &callback : callbacks)
+			{
+				callback();
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				m_continued = true;
+			}
+			m_cvar.notify_all();
+		}
+
+		// Returns once the children completed and the continuations registered
+		// with OnReady before that have returned. Called from one of those
+		// continuations it only waits for the children.
+		void Wait() const
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			m_cvar.wait(lock, [this]()
+			{
+				return m_continued || (m_res_is_ready && std::this_thread::get_id() == m_runner);
+			});
+		}
+
+		bool IsReady() const
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			return m_res_is_ready;
+		}
+
+		// WhenAny: position of the child that completed first. Waits for the
+		// children only, so continuations may call it
+		std::size_t GetIndex() const
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			m_cvar.wait(lock, [this]() { return true == m_res_is_ready; });
+			return m_index;
+		}
+
+		void OnReady(std::function<void()> callback_)
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			if (false == m_res_is_ready)
+			{
+				m_callbacks.push_back(callback_);
+				return;
+			}
+			lock.unlock();
+
+			callback_();
+		}
+
+	private:
+		friend class when_detail::WhenState;
+
+		bool m_res_is_ready;
+		bool m_continued; // every continuation queued by Execute returned
+		std::thread::id m_runner; // worker running the continuations
+		std::size_t m_index; // written before the task is queued
+		std::vector<std::function<void()>> m_callbacks;
+		mutable std::condition_variable m_cvar;
+		mutable std::mutex m_mtx;
+	};
+
+	namespace when_detail
+	{
+		// shared by the children's OnReady callbacks of one combinator, queues the
+		// CombinedFuture once, when the countdown hits zero
+		class WhenState
+		{
+		public:
+			WhenState(ThreadPool &pool_, ThreadPool::Priority priority_, std::size_t count_,
+					  std::shared_ptr<CombinedFuture> future_) :
+				m_pool(pool_), m_priority(priority_), m_remaining(count_), m_future(future_) {}
+
+			WhenState(const WhenState &other_) = delete;
+			WhenState &operator=(const WhenState &other_) = delete;
+
+			// one child completed; WhenAny counts down from 1, so only its first
+			// child gets through and later ones just wrap the counter
+			void Arrive(std::size_t index_)
+			{
+				if (1 != m_remaining.fetch_sub(1, std::memory_order_acq_rel))
+				{
+					return;
+				}
+
+				m_future->m_index = index_;
+				m_pool.AddTask(m_future, m_priority);
+			}
+
+		private:
+			ThreadPool &m_pool;
+			const ThreadPool::Priority m_priority;
+			std::atomic_size_t m_remaining;
+			std::shared_ptr<CombinedFuture> m_future;
+		};
+
+		template <typename Future>
+		void Attach(const std::shared_ptr<WhenState> &state_, std::size_t index_, const std::shared_ptr<Future> &future_)
+		{
+			std::shared_ptr<WhenState> state = state_;
+			future_->OnReady([state, index_]() { state->Arrive(index_); });
+		}
+
+		template <typename... Futures>
+		std::shared_ptr<CombinedFuture> Combine(ThreadPool &pool_, ThreadPool::Priority priority_, std::size_t count_,
+												const std::shared_ptr<Futures> &...futures_)
+		{
+			std::shared_ptr<CombinedFuture> combined = std::make_shared<CombinedFuture>();
+			if (0 == sizeof...(futures_))
+			{
+				pool_.AddTask(combined, priority_);
+				return combined;
+			}
+
+			std::shared_ptr<WhenState> state = std::make_shared<WhenState>(pool_, priority_, count_, combined);
+			std::size_t index = 0;
+			int expand[] = {0, (Attach(state, index++, futures_), 0)...};
+			(void)expand;
+
+			return combined;
+		}
+
+		template <typename Container>
+		std::shared_ptr<CombinedFuture> CombineRange(ThreadPool &pool_, const Container &futures_,
+													 ThreadPool::Priority priority_, bool any_)
+		{
+			std::shared_ptr<CombinedFuture> combined = std::make_shared<CombinedFuture>();
+			std::size_t size = 0;
+			for (auto it = futures_.begin(); it != futures_.end(); ++it)
+			{
+				++size;
+			}
+
+			if (0 == size)
+			{
+				pool_.AddTask(combined, priority_);
+				return combined;
+			}
+
+			std::shared_ptr<WhenState> state = std::make_shared<WhenState>(pool_, priority_, any_ ? 1 : size,
+																		   combined);
+			std::size_t index = 0;
+			for (const auto &future : futures_)
+			{
+				Attach(state, index++, future);
+			}
+
+			return combined;
+		}
+	}
+
+	// completes once every child has completed
+	template <typename... Futures>
+	std::shared_ptr<CombinedFuture> WhenAll(ThreadPool &pool_, ThreadPool::Priority priority_,
+											const std::shared_ptr<Futures> &...futures_)
+	{
+		return when_detail::Combine(pool_, priority_, sizeof...(futures_), futures_...);
+	}
+
+	template <typename... Futures>
+	std::shared_ptr<CombinedFuture> WhenAll(ThreadPool &pool_, const std::shared_ptr<Futures> &...futures_)
+	{
+		return when_detail::Combine(pool_, ThreadPool::NORMAL, sizeof...(futures_), futures_...);
+	}
+
+	// futures_ is any range of shared_ptrs to futures, e.g. a std::vector
+	template <typename Container, typename = typename Container::const_iterator>
+	std::shared_ptr<CombinedFuture> WhenAll(ThreadPool &pool_, const Container &futures_,
+											ThreadPool::Priority priority_ = ThreadPool::NORMAL)
+	{
+		return when_detail::CombineRange(pool_, futures_, priority_, false);
+	}
+
+	// completes once the first child has completed, GetIndex tells which
+	template <typename... Futures>
+	std::shared_ptr<CombinedFuture> WhenAny(ThreadPool &pool_, ThreadPool::Priority priority_,
+											const std::shared_ptr<Futures> &...futures_)
+	{
+		return when_detail::Combine(pool_, priority_, 1, futures_...);
+	}
+
+	template <typename... Futures>
+	std::shared_ptr<CombinedFuture> WhenAny(ThreadPool &pool_, const std::shared_ptr<Futures> &...futures_)
+	{
+		return when_detail::Combine(pool_, ThreadPool::NORMAL, 1, futures_...);
+	}
+
+	template <typename Container, typename = typename Container::const_iterator>
+	std::shared_ptr<CombinedFuture> WhenAny(ThreadPool &pool_, const Container &futures_,
+											ThreadPool::Priority priority_ = ThreadPool::NORMAL)
+	{
+		return when_detail::CombineRange(pool_, futures_, priority_, true);
+	}
+
+} // levi
+
+#endif /* when_all.hpp */
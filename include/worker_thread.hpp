@@ -1,44 +1,130 @@
 #ifndef WORKERTHREAD_HPP
 #define WORKERTHREAD_HPP
 
-#include <thread>			  //	std::thread
+#include <thread>			  //	std::thread::id
 #include <future>			  //	std::function
+#include <atomic>			  //	std::atomic_size_t
+#include <memory>			  //	std::shared_ptr
+#include <vector>			  //	std::vector
+#include <system_error>		  //	std::system_error
+
+#include <limits.h>			  //	PTHREAD_STACK_MIN
+#include <pthread.h>		  //	pthread_create, pthread_attr_setstacksize
+
+#include "task_recorder.hpp"  // levi::RecordBuffer
+#include "task_stats.hpp"	  // levi::TaskStatsTable
 
 namespace levi
 {
     class WorkerThread
     {
     public:
-        WorkerThread(std::function<void()> threadFunc) : m_thread(threadFunc), m_thread_id(m_thread.get_id())
+        // threadFunc receives the worker it runs on, so per-worker state can be
+        // reached without looking the thread up in the pool's map. A non-zero
+        // stackSize sets the thread's stack size, clamped to PTHREAD_STACK_MIN
+        WorkerThread(std::function<void(WorkerThread&)> threadFunc, std::size_t stackSize = 0) :
+                     m_deadline_misses(0), m_func(threadFunc), m_joinable(false)
         {
-            //empty
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if (0 != stackSize)
+            {
+                const std::size_t min = static_cast<std::size_t>(PTHREAD_STACK_MIN);
+                pthread_attr_setstacksize(&attr, (stackSize < min) ? min : stackSize);
+            }
+
+            int error = pthread_create(&m_thread, &attr, &WorkerThread::Start, this);
+            pthread_attr_destroy(&attr);
+            if (0 != error)
+            {
+                throw std::system_error(error, std::generic_category(), "pthread_create");
+            }
+            m_joinable = true;
         }
 
         ~WorkerThread()
+        {
+            JoinThread();
+        }
+
+        WorkerThread(const WorkerThread &other_) = delete;
+        WorkerThread &operator=(const WorkerThread &other_) = delete;
+
+        // default id until the thread has started
+        std::thread::id GetID() const
         {
             std::unique_lock<std::mutex> lock(m_mutex);
-            if(m_thread.joinable())
+            return m_thread_id;
+        }
+
+        void IncDeadlineMisses()
+        {
+            m_deadline_misses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::size_t GetDeadlineMisses() const
+        {
+            return m_deadline_misses.load(std::memory_order_relaxed);
+        }
+
+        // slot of a worker-local context, only touched by the worker's own thread
+        std::shared_ptr<void> &Context(std::size_t index_)
+        {
+            if (m_contexts.size() <= index_)
             {
-                m_thread.join();
+                m_contexts.resize(index_ + 1);
             }
+
+            return m_contexts[index_];
         }
 
-        std::thread::id GetID() const
+        void ClearContexts()
         {
-            return m_thread_id;
+            m_contexts.clear();
+        }
+
+        RecordBuffer &GetRecordBuffer()
+        {
+            return m_record_buffer;
+        }
+
+        TaskStatsTable &GetTaskStats()
+        {
+            return m_task_stats;
         }
 
         void JoinThread()
         {
-            if(m_thread.joinable())
+            std::unique_lock<std::mutex> lock(m_join_mutex);
+            if (m_joinable)
             {
-                m_thread.join();
+                pthread_join(m_thread, nullptr);
+                m_joinable = false;
             }
         }
     private:
-        std::mutex m_mutex;
-        std::thread m_thread;
+        mutable std::mutex m_mutex;
+        std::mutex m_join_mutex;
+        std::atomic_size_t m_deadline_misses;
+        std::vector<std::shared_ptr<void>> m_contexts;
+        RecordBuffer m_record_buffer;
+        TaskStatsTable m_task_stats;
+        std::function<void(WorkerThread&)> m_func;
+        pthread_t m_thread;
+        bool m_joinable;
         std::thread::id m_thread_id;
+
+        static void *Start(void *worker_)
+        {
+            WorkerThread *worker = static_cast<WorkerThread *>(worker_);
+            {
+                std::unique_lock<std::mutex> lock(worker->m_mutex);
+                worker->m_thread_id = std::this_thread::get_id();
+            }
+            worker->m_func(*worker);
+
+            return nullptr;
+        }
     };
 
 } // levi
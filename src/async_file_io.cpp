@@ -0,0 +1,468 @@
+#include <cerrno>			  //	errno
+#include <cstring>			  //	memset
+
+#include <linux/io_uring.h>	  //	io_uring_params, io_uring_sqe, io_uring_cqe
+#include <sys/mman.h>		  //	mmap, munmap
+#include <sys/syscall.h>	  //	__NR_io_uring_setup, __NR_io_uring_enter
+#include <unistd.h>			  //	pread, pwrite, fsync, close, syscall
+
+#include "async_file_io.hpp"
+
+namespace levi
+{
+    IOFuture::IOFuture(Callback callback_) : m_callback(callback_), m_result(0), m_res_is_ready(false)
+    {
+        //empty
+    }
+
+    void IOFuture::Execute()
+    {
+        if (m_callback)
+        {
+            m_callback(m_result);
+        }
+
+        std::vector<std::function<void()>> on_ready;
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_res_is_ready = true;
+            on_ready.swap(m_on_ready);
+        }
+        m_cvar.notify_all();
+
+        for (const std::function<void()> &callback : on_ready)
+        {
+            callback();
+        }
+    }
+
+    void IOFuture::OnReady(std::function<void()> callback_)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        if (false == m_res_is_ready)
+        {
+            m_on_ready.push_back(callback_);
+            return;
+        }
+        lock.unlock();
+
+        callback_();
+    }
+
+    ssize_t IOFuture::GetResult() const
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvar.wait(lock, [this]() { return true == m_res_is_ready; });
+
+        return m_result;
+    }
+
+    bool IOFuture::IsReady() const
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+
+        return m_res_is_ready;
+    }
+
+
+    // mmap'ed io_uring, driven through the raw syscalls
+    struct AsyncFileIO::Ring
+    {
+        int fd;
+        unsigned entries;
+        unsigned cq_entries;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        io_uring_sqe *sqes;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        io_uring_cqe *cqes;
+
+        void *sq_ptr;
+        std::size_t sq_size;
+        void *cq_ptr;
+        std::size_t cq_size;
+        std::size_t sqes_size;
+
+        Ring() : fd(-1), sqes(nullptr), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED) {}
+
+        ~Ring()
+        {
+            if (nullptr != sqes)
+            {
+                munmap(sqes, sqes_size);
+            }
+            if (MAP_FAILED != cq_ptr && cq_ptr != sq_ptr)
+            {
+                munmap(cq_ptr, cq_size);
+            }
+            if (MAP_FAILED != sq_ptr)
+            {
+                munmap(sq_ptr, sq_size);
+            }
+            if (-1 != fd)
+            {
+                close(fd);
+            }
+        }
+
+        bool Setup(unsigned entries_)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries_, &params));
+            if (-1 == fd)
+            {
+                return false;
+            }
+
+            entries = params.sq_entries;
+            cq_entries = params.cq_entries;
+
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+            }
+
+            sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQ_RING);
+            if (MAP_FAILED == sq_ptr)
+            {
+                return false;
+            }
+
+            cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr :
+                     mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+            if (MAP_FAILED == cq_ptr)
+            {
+                return false;
+            }
+
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            void *sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  fd, IORING_OFF_SQES);
+            if (MAP_FAILED == sqes_ptr)
+            {
+                return false;
+            }
+            sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+
+            char *sq = static_cast<char *>(sq_ptr);
+            sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+            char *cq = static_cast<char *>(cq_ptr);
+            cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+            return true;
+        }
+
+        int Enter(unsigned toSubmit_, unsigned minComplete_, unsigned flags_)
+        {
+            return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit_, minComplete_,
+                                            flags_, nullptr, 0));
+        }
+    };
+
+
+    AsyncFileIO::AsyncFileIO(ThreadPool &pool_, std::size_t queueDepth_,
+                             std::size_t blockingThreads_, Backend backend_) :
+        m_pool(pool_), m_inflight(0), m_max_inflight(0), m_unsubmitted(0), m_flushing(false),
+        m_ring_error(0), m_stop(false)
+    {
+        if (AUTO_BACKEND == backend_)
+        {
+            std::unique_ptr<Ring> ring(new Ring);
+            if (ring->Setup(static_cast<unsigned>(queueDepth_)))
+            {
+                m_ring.swap(ring);
+                m_max_inflight = m_ring->cq_entries;
+                m_reaper = std::thread([this]() { ReapCompletions(); });
+
+                return;
+            }
+        }
+
+        if (0 == blockingThreads_)
+        {
+            blockingThreads_ = 1;
+        }
+        for (std::size_t i = 0; i < blockingThreads_; ++i)
+        {
+            m_blocking_threads.push_back(std::thread([this]() { BlockingExec(); }));
+        }
+    }
+
+    AsyncFileIO::~AsyncFileIO() noexcept
+    {
+        if (m_ring)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_submit_mutex);
+                m_stop = true;
+            }
+
+            // a NOP with no request wakes the reaper once everything drained
+            SubmitToRing(nullptr);
+            m_reaper.join();
+
+            return;
+        }
+
+        for (std::size_t i = 0; i < m_blocking_threads.size(); ++i)
+        {
+            m_blocking_queue.Push(nullptr);
+        }
+        for (std::thread &thread : m_blocking_threads)
+        {
+            thread.join();
+        }
+    }
+
+    AsyncFileIO::IOFuturePtr AsyncFileIO::ReadAsync(int fd_, void *buf_, std::size_t len_, off_t offset_,
+                                                    IOFuture::Callback callback_, ThreadPool::Priority priority_)
+    {
+        return Submit(READ_OP, fd_, buf_, len_, offset_, callback_, priority_);
+    }
+
+    AsyncFileIO::IOFuturePtr AsyncFileIO::WriteAsync(int fd_, const void *buf_, std::size_t len_, off_t offset_,
+                                                     IOFuture::Callback callback_, ThreadPool::Priority priority_)
+    {
+        return Submit(WRITE_OP, fd_, const_cast<void *>(buf_), len_, offset_, callback_, priority_);
+    }
+
+    AsyncFileIO::IOFuturePtr AsyncFileIO::FsyncAsync(int fd_, IOFuture::Callback callback_,
+                                                     ThreadPool::Priority priority_)
+    {
+        return Submit(FSYNC_OP, fd_, nullptr, 0, 0, callback_, priority_);
+    }
+
+    bool AsyncFileIO::UsesIoUring() const
+    {
+        return static_cast<bool>(m_ring);
+    }
+
+    AsyncFileIO::IOFuturePtr AsyncFileIO::Submit(Opcode opcode_, int fd_, void *buf_, std::size_t len_,
+                                                 off_t offset_, IOFuture::Callback callback_,
+                                                 ThreadPool::Priority priority_)
+    {
+        IOFuturePtr future = std::make_shared<IOFuture>(callback_);
+        Request *request = new Request{opcode_, fd_, buf_, len_, offset_, future, priority_, {buf_, len_}};
+
+        if (m_ring)
+        {
+            SubmitToRing(request);
+        }
+        else
+        {
+            m_blocking_queue.Push(request);
+        }
+
+        return future;
+    }
+
+    void AsyncFileIO::SubmitToRing(Request *request_)
+    {
+        std::vector<Request *> failed;
+        int error = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_submit_mutex);
+            // a full SQ holds SQEs the flusher has yet to enter, it notifies
+            // once the kernel took them
+            m_submit_cv.wait(lock, [this, request_]()
+            {
+                return 0 != m_ring_error ||
+                       ((nullptr == request_ || m_inflight < m_max_inflight) &&
+                        *m_ring->sq_tail - __atomic_load_n(m_ring->sq_head, __ATOMIC_ACQUIRE) < m_ring->entries);
+            });
+            if (0 != m_ring_error)
+            {
+                error = m_ring_error;
+                lock.unlock();
+                if (nullptr != request_)
+                {
+                    Complete(request_, -error);
+                }
+
+                return;
+            }
+            if (nullptr != request_)
+            {
+                ++m_inflight;
+            }
+
+            unsigned tail = *m_ring->sq_tail;
+            unsigned index = tail & *m_ring->sq_mask;
+            io_uring_sqe *sqe = &m_ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->user_data = reinterpret_cast<uint64_t>(request_);
+
+            if (nullptr == request_)
+            {
+                sqe->opcode = IORING_OP_NOP;
+            }
+            else if (FSYNC_OP == request_->opcode)
+            {
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = request_->fd;
+            }
+            else
+            {
+                sqe->opcode = (READ_OP == request_->opcode) ? IORING_OP_READV : IORING_OP_WRITEV;
+                sqe->fd = request_->fd;
+                sqe->addr = reinterpret_cast<uint64_t>(&request_->vec);
+                sqe->len = 1;
+                sqe->off = static_cast<uint64_t>(request_->offset);
+            }
+
+            m_ring->sq_array[index] = index;
+            __atomic_store_n(m_ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ++m_unsubmitted;
+
+            // a running flusher takes this SQE with its next enter
+            if (m_flushing)
+            {
+                return;
+            }
+            m_flushing = true;
+            FlushRing(lock, failed);
+            error = m_ring_error;
+        }
+
+        for (Request *request : failed)
+        {
+            Complete(request, -error);
+        }
+    }
+
+    void AsyncFileIO::FlushRing(std::unique_lock<std::mutex> &lock_, std::vector<Request *> &failed_)
+    {
+        // enters outside the lock, so SQEs published meanwhile go into the
+        // next enter instead of one syscall each
+        while (0 != m_unsubmitted)
+        {
+            unsigned pending = m_unsubmitted;
+            lock_.unlock();
+            int submitted = m_ring->Enter(pending, 0, 0);
+            int error = (submitted < 0) ? errno : 0;
+            if (EAGAIN == error || EBUSY == error)
+            {
+                // out of kernel resources or completions, the reaper frees them
+                std::this_thread::yield();
+            }
+            lock_.lock();
+
+            if (submitted > 0)
+            {
+                m_unsubmitted -= static_cast<unsigned>(submitted);
+                m_submit_cv.notify_all();
+            }
+            else if (0 != error && EINTR != error && EAGAIN != error && EBUSY != error)
+            {
+                // the ring is unusable; fail what it still holds and every
+                // later request instead of retrying forever
+                m_ring_error = error;
+                unsigned tail = *m_ring->sq_tail;
+                for (unsigned head = *m_ring->sq_head; head != tail; ++head)
+                {
+                    io_uring_sqe &sqe = m_ring->sqes[m_ring->sq_array[head & *m_ring->sq_mask]];
+                    Request *request = reinterpret_cast<Request *>(sqe.user_data);
+                    if (nullptr != request)
+                    {
+                        failed_.push_back(request);
+                    }
+                }
+                m_inflight -= failed_.size();
+                m_unsubmitted = 0;
+                m_submit_cv.notify_all();
+            }
+        }
+        m_flushing = false;
+    }
+
+    void AsyncFileIO::ReapCompletions()
+    {
+        while (true)
+        {
+            m_ring->Enter(0, 1, IORING_ENTER_GETEVENTS);
+
+            std::size_t completed = 0;
+            unsigned head = *m_ring->cq_head;
+            unsigned tail = __atomic_load_n(m_ring->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head)
+            {
+                io_uring_cqe &cqe = m_ring->cqes[head & *m_ring->cq_mask];
+                Request *request = reinterpret_cast<Request *>(cqe.user_data);
+                if (nullptr != request)
+                {
+                    Complete(request, cqe.res);
+                    ++completed;
+                }
+            }
+            __atomic_store_n(m_ring->cq_head, head, __ATOMIC_RELEASE);
+
+            std::unique_lock<std::mutex> lock(m_submit_mutex);
+            m_inflight -= completed;
+            if (0 != completed)
+            {
+                m_submit_cv.notify_all();
+            }
+            if (m_stop && 0 == m_inflight)
+            {
+                return;
+            }
+        }
+    }
+
+    void AsyncFileIO::BlockingExec()
+    {
+        Request *request = nullptr;
+        while (true)
+        {
+            m_blocking_queue.Pop(request);
+            if (nullptr == request)
+            {
+                return;
+            }
+
+            ssize_t result = 0;
+            switch (request->opcode)
+            {
+                case READ_OP:
+                    result = pread(request->fd, request->buf, request->len, request->offset);
+                    break;
+                case WRITE_OP:
+                    result = pwrite(request->fd, request->buf, request->len, request->offset);
+                    break;
+                case FSYNC_OP:
+                    result = fsync(request->fd);
+                    break;
+            }
+
+            Complete(request, (-1 == result) ? -errno : result);
+        }
+    }
+
+    void AsyncFileIO::Complete(Request *request_, ssize_t result_)
+    {
+        request_->future->m_result = result_;
+        m_pool.AddTask(request_->future, request_->priority);
+
+        delete request_;
+    }
+
+} // levi
@@ -0,0 +1,227 @@
+#include <algorithm>		  //	std::min
+#include <cstdlib>			  //	strtoll
+#include <fstream>			  //	std::ifstream
+#include <sstream>			  //	std::istringstream
+#include <thread>			  //	std::thread::hardware_concurrency
+
+#include <sched.h>			  //	sched_getaffinity, CPU_COUNT
+
+#include "cpu_quota.hpp"
+
+namespace levi
+{
+    // where a cgroup hierarchy is mounted, from /proc/self/mountinfo
+    struct CgroupMount
+    {
+        std::string root;  // cgroup path shown at the mount point
+        std::string point;
+    };
+
+    static bool HasToken(const std::string &list_, const std::string &token_)
+    {
+        std::istringstream tokens(list_);
+        std::string token;
+        while (std::getline(tokens, token, ','))
+        {
+            if (token == token_)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // this process's cgroup path in the v1 hierarchy holding controller_, or
+    // in the v2 hierarchy when controller_ is empty
+    static bool CgroupPath(const std::string &controller_, std::string &path_)
+    {
+        std::ifstream file("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(file, line))
+        {
+            // hierarchy-ID:controller-list:path
+            std::size_t first = line.find(':');
+            std::size_t second = line.find(':', first + 1);
+            if (std::string::npos == first || std::string::npos == second)
+            {
+                continue;
+            }
+
+            std::string controllers = line.substr(first + 1, second - first - 1);
+            if (controller_.empty() ? controllers.empty() : HasToken(controllers, controller_))
+            {
+                path_ = line.substr(second + 1);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool CgroupMountPoint(const std::string &controller_, CgroupMount &mount_)
+    {
+        std::ifstream file("/proc/self/mountinfo");
+        std::string line;
+        while (std::getline(file, line))
+        {
+            // id parent major:minor root point options [optional...] - type source super-options
+            std::size_t separator = line.find(" - ");
+            if (std::string::npos == separator)
+            {
+                continue;
+            }
+
+            std::istringstream mount(line.substr(0, separator));
+            std::string id, parent, device;
+            CgroupMount found;
+            mount >> id >> parent >> device >> found.root >> found.point;
+
+            std::istringstream super(line.substr(separator + 3));
+            std::string type, source, options;
+            super >> type >> source >> options;
+
+            bool match = controller_.empty() ? ("cgroup2" == type) :
+                                               ("cgroup" == type && HasToken(options, controller_));
+            if (match)
+            {
+                mount_ = found;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // tightest of two quotas, 0 meaning unlimited
+    static double Tighter(double quota_, double other_)
+    {
+        if (0 >= other_)
+        {
+            return quota_;
+        }
+        if (0 >= quota_)
+        {
+            return other_;
+        }
+
+        return std::min(quota_, other_);
+    }
+
+    // walks from the process's cgroup up to the hierarchy root, a parent's
+    // quota caps its children
+    template <typename READ>
+    static double HierarchyQuota(const std::string &controller_, READ read_)
+    {
+        std::string path;
+        CgroupMount mount;
+        if (false == CgroupPath(controller_, path) || false == CgroupMountPoint(controller_, mount))
+        {
+            return 0;
+        }
+
+        // the mount shows the hierarchy from mount.root down
+        if ("/" != mount.root && 0 == path.compare(0, mount.root.size(), mount.root))
+        {
+            path = path.substr(mount.root.size());
+        }
+        else if ("/" != mount.root)
+        {
+            path.clear();
+        }
+
+        double quota = 0;
+        while (true)
+        {
+            quota = Tighter(quota, read_(mount.point + path));
+
+            std::size_t slash = path.find_last_of('/');
+            if (path.empty() || std::string::npos == slash)
+            {
+                break;
+            }
+            path.erase(slash);
+        }
+
+        return quota;
+    }
+
+    static double ReadCpuMax(const std::string &dir_)
+    {
+        std::ifstream file(dir_ + "/cpu.max");
+        std::string line;
+        if (!std::getline(file, line))
+        {
+            return 0;
+        }
+
+        return ParseCpuMax(line);
+    }
+
+    static double ReadCfsQuota(const std::string &dir_)
+    {
+        std::ifstream quota_file(dir_ + "/cpu.cfs_quota_us");
+        std::ifstream period_file(dir_ + "/cpu.cfs_period_us");
+        long long quota = 0;
+        long long period = 0;
+        if (!(quota_file >> quota) || !(period_file >> period))
+        {
+            return 0;
+        }
+
+        return CfsQuotaCpus(quota, period);
+    }
+
+    std::size_t AffinityCpus()
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (0 == sched_getaffinity(0, sizeof(set), &set))
+        {
+            int count = CPU_COUNT(&set);
+            if (0 < count)
+            {
+                return static_cast<std::size_t>(count);
+            }
+        }
+
+        unsigned hardware = std::thread::hardware_concurrency();
+        return 0 == hardware ? 1 : hardware;
+    }
+
+    double CgroupCpuQuota()
+    {
+        // hybrid hosts mount both, the cpu controller lives in one of them
+        return Tighter(HierarchyQuota("", ReadCpuMax), HierarchyQuota("cpu", ReadCfsQuota));
+    }
+
+    double AvailableCpus()
+    {
+        return Tighter(static_cast<double>(AffinityCpus()), CgroupCpuQuota());
+    }
+
+    double ParseCpuMax(const std::string &cpuMax_)
+    {
+        std::istringstream fields(cpuMax_);
+        std::string quota;
+        long long period = 100000; // kernel default when only the quota is written
+        if (!(fields >> quota) || "max" == quota)
+        {
+            return 0;
+        }
+        fields >> period;
+
+        return CfsQuotaCpus(strtoll(quota.c_str(), nullptr, 10), period);
+    }
+
+    double CfsQuotaCpus(long long quota_, long long period_)
+    {
+        if (0 >= quota_ || 0 >= period_)
+        {
+            return 0;
+        }
+
+        return static_cast<double>(quota_) / static_cast<double>(period_);
+    }
+
+} // levi
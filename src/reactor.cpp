@@ -0,0 +1,145 @@
+#include <stdexcept>		  //	std::runtime_error
+#include <cerrno>			  //	errno
+
+#include <sys/epoll.h>		  //	epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h>	  //	eventfd
+#include <unistd.h>			  //	read, write, close
+
+#include "reactor.hpp"
+
+namespace levi
+{
+    Reactor::Reactor() : m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+                         m_event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE))
+    {
+        if (-1 == m_epoll_fd || -1 == m_event_fd)
+        {
+            throw std::runtime_error("Reactor: epoll/eventfd creation failed");
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = m_event_fd;
+        if (-1 == epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_event_fd, &event))
+        {
+            throw std::runtime_error("Reactor: failed to watch the wakeup eventfd");
+        }
+    }
+
+    Reactor::~Reactor() noexcept
+    {
+        close(m_event_fd);
+        close(m_epoll_fd);
+    }
+
+    void Reactor::Watch(HandlerPtr handler_)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        epoll_event event = {};
+        event.events = handler_->events | EPOLLONESHOT;
+        event.data.fd = handler_->fd;
+        if (-1 == epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, handler_->fd, &event))
+        {
+            throw std::runtime_error("Reactor: epoll_ctl ADD failed");
+        }
+
+        m_handlers[handler_->fd] = handler_;
+    }
+
+    void Reactor::Unwatch(int fd_)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto handler = m_handlers.find(fd_);
+        if (handler == m_handlers.end())
+        {
+            return;
+        }
+        const Handler *unwatched = handler->second.get();
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd_, nullptr);
+        m_handlers.erase(handler);
+
+        // the handler is no longer current, so no new callback starts
+        m_finished.wait(lock, [this, unwatched]()
+        {
+            auto running = m_running.find(unwatched);
+            return running == m_running.end() || running->second == std::this_thread::get_id();
+        });
+    }
+
+    void Reactor::Run(const Handler &handler_, uint32_t revents_)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // skip handlers that were unwatched (or replaced) since Wait
+            if (false == IsCurrent(handler_))
+            {
+                return;
+            }
+            m_running[&handler_] = std::this_thread::get_id();
+        }
+
+        handler_.callback(revents_);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_running.erase(&handler_);
+        m_finished.notify_all();
+        if (false == IsCurrent(handler_))
+        {
+            return;
+        }
+
+        epoll_event event = {};
+        event.events = handler_.events | EPOLLONESHOT;
+        event.data.fd = handler_.fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, handler_.fd, &event);
+    }
+
+    bool Reactor::IsCurrent(const Handler &handler_) const
+    {
+        auto current = m_handlers.find(handler_.fd);
+
+        return current != m_handlers.end() && current->second.get() == &handler_;
+    }
+
+    void Reactor::Notify(uint64_t count_)
+    {
+        uint64_t token = count_;
+        while (-1 == write(m_event_fd, &token, sizeof(token)) && EINTR == errno)
+        {
+            // retry
+        }
+    }
+
+    Reactor::HandlerPtr Reactor::Wait(uint32_t &revents_)
+    {
+        // one event per call, so ready fds spread over the idle workers
+        epoll_event event = {};
+        if (1 != epoll_wait(m_epoll_fd, &event, 1, -1))
+        {
+            return nullptr; // EINTR, caller re-checks the queue
+        }
+
+        if (event.data.fd == m_event_fd)
+        {
+            // consume one token; losing the race to another worker is fine
+            uint64_t token = 0;
+            ssize_t ret = read(m_event_fd, &token, sizeof(token));
+            (void)ret;
+
+            return nullptr;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto handler = m_handlers.find(event.data.fd);
+        if (handler == m_handlers.end())
+        {
+            return nullptr;
+        }
+
+        revents_ = event.events;
+        return handler->second;
+    }
+
+} // levi
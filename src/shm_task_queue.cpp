@@ -0,0 +1,383 @@
+#include <algorithm>		  //	std::min
+#include <cerrno>			  //	errno
+#include <cstring>			  //	memcpy
+#include <new>				  //	placement new
+
+#include <fcntl.h>			  //	O_CREAT, O_EXCL, O_RDWR
+#include <linux/futex.h>	  //	FUTEX_WAIT, FUTEX_WAKE
+#include <sys/mman.h>		  //	shm_open, shm_unlink, mmap, munmap
+#include <sys/stat.h>		  //	fstat
+#include <sys/syscall.h>	  //	SYS_futex
+#include <time.h>			  //	timespec
+#include <unistd.h>			  //	ftruncate, close, syscall
+
+#include "shm_task_queue.hpp"
+
+namespace levi
+{
+    static const uint64_t SHM_QUEUE_MAGIC = 0x5450534851554555ULL; // "TPSHQUEU"
+    static const std::size_t CACHE_LINE = 64;
+
+    // lives at the start of the segment; std::atomic of these sizes is
+    // lock-free and address-free, so it works across processes
+    struct ShmTaskQueue::Header
+    {
+        std::atomic<uint64_t> magic;
+        uint64_t mask;
+        char pad0[CACHE_LINE - 2 * sizeof(uint64_t)];
+
+        std::atomic<uint64_t> enqueue_pos;
+        char pad1[CACHE_LINE - sizeof(uint64_t)];
+
+        std::atomic<uint64_t> dequeue_pos;
+        char pad2[CACHE_LINE - sizeof(uint64_t)];
+
+        std::atomic<uint32_t> items;			 // futex word, bumped on every push
+        std::atomic<uint32_t> consumers_waiting;
+        char pad3[CACHE_LINE - 2 * sizeof(uint32_t)];
+
+        std::atomic<uint32_t> space;			 // futex word, bumped on every pop
+        std::atomic<uint32_t> producers_waiting;
+        char pad4[CACHE_LINE - 2 * sizeof(uint32_t)];
+    };
+
+    struct ShmTaskQueue::Cell
+    {
+        std::atomic<uint64_t> sequence;
+        ShmRecord record;
+    };
+
+    static long Futex(std::atomic<uint32_t> *word_, int op_, uint32_t value_, const timespec *timeout_)
+    {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word_), op_, value_, timeout_, nullptr, 0);
+    }
+
+    std::unique_ptr<ShmTaskQueue> ShmTaskQueue::Create(const std::string &name_, std::size_t capacity_)
+    {
+        std::size_t capacity = 2;
+        while (capacity < capacity_)
+        {
+            capacity <<= 1;
+        }
+        std::size_t size = sizeof(Header) + capacity * sizeof(Cell);
+
+        int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (-1 == fd)
+        {
+            return nullptr;
+        }
+
+        void *mapping = MAP_FAILED;
+        if (0 == ftruncate(fd, static_cast<off_t>(size)))
+        {
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+
+        if (MAP_FAILED == mapping)
+        {
+            shm_unlink(name_.c_str());
+            return nullptr;
+        }
+
+        Header *header = new (mapping) Header;
+        header->mask = capacity - 1;
+        header->enqueue_pos = 0;
+        header->dequeue_pos = 0;
+        header->items = 0;
+        header->consumers_waiting = 0;
+        header->space = 0;
+        header->producers_waiting = 0;
+
+        Cell *cells = reinterpret_cast<Cell *>(header + 1);
+        for (std::size_t i = 0; i < capacity; ++i)
+        {
+            new (&cells[i]) Cell;
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        // published last, Open refuses a segment that is still being built
+        header->magic.store(SHM_QUEUE_MAGIC, std::memory_order_release);
+
+        return std::unique_ptr<ShmTaskQueue>(new ShmTaskQueue(name_, mapping, size, capacity - 1, true));
+    }
+
+    std::unique_ptr<ShmTaskQueue> ShmTaskQueue::Open(const std::string &name_)
+    {
+        int fd = shm_open(name_.c_str(), O_RDWR, 0);
+        if (-1 == fd)
+        {
+            return nullptr;
+        }
+
+        struct stat info;
+        void *mapping = MAP_FAILED;
+        if (0 == fstat(fd, &info) && static_cast<std::size_t>(info.st_size) > sizeof(Header))
+        {
+            mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+
+        if (MAP_FAILED == mapping)
+        {
+            return nullptr;
+        }
+
+        Header *header = static_cast<Header *>(mapping);
+        if (SHM_QUEUE_MAGIC != header->magic.load(std::memory_order_acquire))
+        {
+            munmap(mapping, info.st_size);
+            return nullptr;
+        }
+
+        // the segment is written by other processes, so the ring it claims
+        // has to be a power of two that fits the mapping. The checked mask is
+        // kept, later writes to the header's copy are not trusted
+        uint64_t mask = header->mask;
+        uint64_t capacity = mask + 1;
+        uint64_t fits = (static_cast<std::size_t>(info.st_size) - sizeof(Header)) / sizeof(Cell);
+        if (capacity < 2 || 0 != (capacity & mask) || capacity > fits)
+        {
+            munmap(mapping, info.st_size);
+            return nullptr;
+        }
+
+        return std::unique_ptr<ShmTaskQueue>(new ShmTaskQueue(name_, mapping, info.st_size, mask, false));
+    }
+
+    ShmTaskQueue::ShmTaskQueue(const std::string &name_, void *mapping_, std::size_t size_, uint64_t mask_,
+                               bool owner_) :
+        m_name(name_), m_mapping(mapping_), m_size(size_), m_mask(mask_), m_owner(owner_),
+        m_header(static_cast<Header *>(mapping_)), m_cells(reinterpret_cast<Cell *>(m_header + 1))
+    {
+        //empty
+    }
+
+    ShmTaskQueue::~ShmTaskQueue() noexcept
+    {
+        munmap(m_mapping, m_size);
+        if (m_owner)
+        {
+            shm_unlink(m_name.c_str());
+        }
+    }
+
+    bool ShmTaskQueue::TryPush(uint32_t handlerId_, const void *payload_, std::size_t length_)
+    {
+        if (length_ > ShmRecord::MAX_PAYLOAD)
+        {
+            return false;
+        }
+
+        uint64_t pos = m_header->enqueue_pos.load(std::memory_order_relaxed);
+        Cell *cell = nullptr;
+        while (true)
+        {
+            cell = &m_cells[pos & m_mask];
+            uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+
+            if (0 == diff)
+            {
+                if (m_header->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = m_header->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->record.handler_id = handlerId_;
+        cell->record.length = static_cast<uint32_t>(length_);
+        memcpy(cell->record.payload, payload_, length_);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        ++m_header->items;
+        if (0 != m_header->consumers_waiting.load())
+        {
+            Futex(&m_header->items, FUTEX_WAKE, 1, nullptr);
+        }
+
+        return true;
+    }
+
+    bool ShmTaskQueue::Push(uint32_t handlerId_, const void *payload_, std::size_t length_)
+    {
+        if (length_ > ShmRecord::MAX_PAYLOAD)
+        {
+            return false;
+        }
+
+        while (false == TryPush(handlerId_, payload_, length_))
+        {
+            uint32_t seen = m_header->space.load();
+            ++m_header->producers_waiting;
+            if (TryPush(handlerId_, payload_, length_))
+            {
+                --m_header->producers_waiting;
+                return true;
+            }
+            Futex(&m_header->space, FUTEX_WAIT, seen, nullptr);
+            --m_header->producers_waiting;
+        }
+
+        return true;
+    }
+
+    bool ShmTaskQueue::TryPop(ShmRecord &out_)
+    {
+        uint64_t pos = m_header->dequeue_pos.load(std::memory_order_relaxed);
+        Cell *cell = nullptr;
+        while (true)
+        {
+            cell = &m_cells[pos & m_mask];
+            uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos + 1);
+
+            if (0 == diff)
+            {
+                if (m_header->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                pos = m_header->dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        out_.handler_id = cell->record.handler_id;
+        // a peer process could have written any length
+        out_.length = std::min(cell->record.length, static_cast<uint32_t>(ShmRecord::MAX_PAYLOAD));
+        memcpy(out_.payload, cell->record.payload, out_.length);
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+
+        ++m_header->space;
+        if (0 != m_header->producers_waiting.load())
+        {
+            Futex(&m_header->space, FUTEX_WAKE, 1, nullptr);
+        }
+
+        return true;
+    }
+
+    bool ShmTaskQueue::Pop(ShmRecord &out_, const std::chrono::milliseconds &timeout_)
+    {
+        if (TryPop(out_))
+        {
+            return true;
+        }
+
+        uint32_t seen = m_header->items.load();
+        ++m_header->consumers_waiting;
+        if (TryPop(out_))
+        {
+            --m_header->consumers_waiting;
+            return true;
+        }
+
+        timespec timeout;
+        timeout.tv_sec = static_cast<time_t>(timeout_.count() / 1000);
+        timeout.tv_nsec = static_cast<long>((timeout_.count() % 1000) * 1000000);
+        Futex(&m_header->items, FUTEX_WAIT, seen, &timeout);
+        --m_header->consumers_waiting;
+
+        return TryPop(out_);
+    }
+
+    void ShmTaskQueue::WakeConsumers()
+    {
+        ++m_header->items;
+        Futex(&m_header->items, FUTEX_WAKE, INT32_MAX, nullptr);
+    }
+
+
+    // runs one record's handler on a pool worker
+    class ShmJobTask : public ThreadPool::ITask
+    {
+    public:
+        ShmJobTask(std::shared_ptr<ShmTaskServer::Handler> handler_, const ShmRecord &record_) :
+            m_handler(handler_), m_length(record_.length)
+        {
+            memcpy(m_payload, record_.payload, m_length);
+        }
+
+        void Execute()
+        {
+            (*m_handler)(m_payload, m_length);
+        }
+
+    private:
+        std::shared_ptr<ShmTaskServer::Handler> m_handler;
+        std::size_t m_length;
+        char m_payload[ShmRecord::MAX_PAYLOAD];
+    };
+
+    ShmTaskServer::ShmTaskServer(ThreadPool &pool_, ShmTaskQueue &queue_, ThreadPool::Priority priority_) :
+        m_pool(pool_), m_queue(queue_), m_priority(priority_), m_unhandled(0), m_stop(false),
+        m_pump([this]() { Pump(); })
+    {
+        //empty
+    }
+
+    ShmTaskServer::~ShmTaskServer() noexcept
+    {
+        m_stop = true;
+        m_queue.WakeConsumers();
+        m_pump.join();
+    }
+
+    void ShmTaskServer::RegisterHandler(uint32_t handlerId_, Handler handler_)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_handlers[handlerId_] = std::make_shared<Handler>(handler_);
+    }
+
+    std::size_t ShmTaskServer::GetUnhandled() const
+    {
+        return m_unhandled;
+    }
+
+    void ShmTaskServer::Pump()
+    {
+        ShmRecord record;
+        while (false == m_stop)
+        {
+            if (false == m_queue.Pop(record, std::chrono::milliseconds(100)))
+            {
+                continue;
+            }
+
+            std::shared_ptr<Handler> handler;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                auto found = m_handlers.find(record.handler_id);
+                if (found != m_handlers.end())
+                {
+                    handler = found->second;
+                }
+            }
+
+            if (!handler)
+            {
+                ++m_unhandled;
+                continue;
+            }
+
+            m_pool.AddTask(std::make_shared<ShmJobTask>(handler, record), m_priority);
+        }
+    }
+
+} // levi
@@ -0,0 +1,189 @@
+#include <cstring>			  //	memcmp, memcpy
+#include <unordered_map>	  //	std::unordered_map
+
+#include "task_recorder.hpp"
+
+namespace levi
+{
+    static const char MAGIC[4] = {'T', 'P', 'R', 'C'};
+
+    TaskRecorder::TaskRecorder() : m_recording(false), m_file(nullptr)
+    {
+        //empty
+    }
+
+    TaskRecorder::~TaskRecorder() noexcept
+    {
+        Stop();
+        Close();
+    }
+
+    bool TaskRecorder::Start(const std::string &path_)
+    {
+        std::unique_lock<std::mutex> lock(m_file_mutex);
+        if (nullptr != m_file)
+        {
+            return false;
+        }
+
+        m_file = std::fopen(path_.c_str(), "wb");
+        if (nullptr == m_file)
+        {
+            return false;
+        }
+
+        TaskRecordHeader header;
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        std::fwrite(&header, sizeof(header), 1, m_file);
+
+        m_start = Clock::now();
+        m_recording.store(true, std::memory_order_release);
+
+        return true;
+    }
+
+    void TaskRecorder::Stop()
+    {
+        m_recording.store(false, std::memory_order_release);
+    }
+
+    void TaskRecorder::Close()
+    {
+        for (RecordBuffer &submits : m_submits)
+        {
+            Flush(submits);
+        }
+
+        std::unique_lock<std::mutex> lock(m_file_mutex);
+        if (nullptr != m_file)
+        {
+            std::fclose(m_file);
+            m_file = nullptr;
+        }
+    }
+
+    void TaskRecorder::AppendSubmit(uint64_t id_, Clock::time_point submitted_, uint32_t producer_, int priority_)
+    {
+        using namespace std::chrono;
+
+        if (false == IsRecording())
+        {
+            return;
+        }
+
+        TaskLogEntry entry = {};
+        entry.id = id_;
+        entry.ns = (submitted_ > m_start) ?
+                   static_cast<uint64_t>(duration_cast<nanoseconds>(submitted_ - m_start).count()) : 0;
+        entry.producer = producer_;
+        entry.priority = static_cast<uint8_t>(priority_);
+        entry.kind = TaskLogEntry::SUBMIT;
+
+        Append(m_submits[producer_ % SUBMIT_SHARDS], entry);
+    }
+
+    void TaskRecorder::AppendComplete(RecordBuffer &buffer_, uint64_t id_, Clock::duration duration_)
+    {
+        using namespace std::chrono;
+
+        if (false == IsRecording())
+        {
+            return;
+        }
+
+        TaskLogEntry entry = {};
+        entry.id = id_;
+        entry.ns = static_cast<uint64_t>(duration_cast<nanoseconds>(duration_).count());
+        entry.kind = TaskLogEntry::COMPLETE;
+
+        Append(buffer_, entry);
+    }
+
+    void TaskRecorder::Append(RecordBuffer &buffer_, const TaskLogEntry &entry_)
+    {
+        std::vector<TaskLogEntry> full;
+        {
+            std::unique_lock<std::mutex> lock(buffer_.m_mutex);
+            buffer_.m_entries.push_back(entry_);
+            if (buffer_.m_entries.size() < FLUSH_RECORDS)
+            {
+                return;
+            }
+            full.swap(buffer_.m_entries);
+        }
+
+        Write(full);
+    }
+
+    void TaskRecorder::Flush(RecordBuffer &buffer_)
+    {
+        std::vector<TaskLogEntry> entries;
+        {
+            std::unique_lock<std::mutex> lock(buffer_.m_mutex);
+            entries.swap(buffer_.m_entries);
+        }
+
+        Write(entries);
+    }
+
+    void TaskRecorder::Write(const std::vector<TaskLogEntry> &entries_)
+    {
+        std::unique_lock<std::mutex> lock(m_file_mutex);
+        if (nullptr != m_file && !entries_.empty())
+        {
+            std::fwrite(entries_.data(), sizeof(TaskLogEntry), entries_.size(), m_file);
+        }
+    }
+
+    bool TaskRecorder::Load(const std::string &path_, std::vector<TaskRecord> &out_)
+    {
+        std::FILE *file = std::fopen(path_.c_str(), "rb");
+        if (nullptr == file)
+        {
+            return false;
+        }
+
+        TaskRecordHeader header;
+        if (1 != std::fread(&header, sizeof(header), 1, file) ||
+            0 != memcmp(header.magic, MAGIC, sizeof(header.magic)) || VERSION != header.version)
+        {
+            std::fclose(file);
+            return false;
+        }
+
+        // a completion may be flushed before its submit, so join after reading all
+        std::vector<TaskLogEntry> completions;
+        std::unordered_map<uint64_t, std::size_t> submitted;
+        TaskLogEntry entry;
+        while (1 == std::fread(&entry, sizeof(entry), 1, file))
+        {
+            if (TaskLogEntry::COMPLETE == entry.kind)
+            {
+                completions.push_back(entry);
+                continue;
+            }
+
+            TaskRecord record = {};
+            record.submit_ns = entry.ns;
+            record.producer = entry.producer;
+            record.priority = entry.priority;
+            submitted[entry.id] = out_.size();
+            out_.push_back(record);
+        }
+        std::fclose(file);
+
+        for (const TaskLogEntry &completion : completions)
+        {
+            auto record = submitted.find(completion.id);
+            if (record != submitted.end())
+            {
+                out_[record->second].duration_ns = completion.ns;
+                out_[record->second].completed = 1;
+            }
+        }
+
+        return true;
+    }
+
+} // levi
@@ -0,0 +1,139 @@
+#include <cstdlib>			  //	free
+#include <functional>		  //	std::hash
+#include <vector>			  //	std::vector
+#include <cxxabi.h>			  //	abi::__cxa_demangle
+#include <time.h>			  //	clock_gettime, CLOCK_THREAD_CPUTIME_ID
+
+#include "task_stats.hpp"
+
+namespace levi
+{
+    static void Accumulate(TaskStats &into_, const TaskStats &from_)
+    {
+        into_.count += from_.count;
+        into_.wall += from_.wall;
+        into_.cpu += from_.cpu;
+        into_.queue_wait += from_.queue_wait;
+    }
+
+    static std::string Demangle(const char *tag_)
+    {
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(tag_, nullptr, nullptr, &status);
+        if (0 != status || nullptr == demangled)
+        {
+            return tag_;
+        }
+
+        std::string name(demangled);
+        free(demangled);
+
+        return name;
+    }
+
+    TaskStatsTable::TaskStatsTable()
+    {
+        m_other.text = "(other)";
+        m_other.tag.store(m_other.text.c_str(), std::memory_order_release);
+    }
+
+    TaskStatsTable::Slot &TaskStatsTable::Find(const char *tag_, bool typeName_, const char *text_)
+    {
+        std::size_t start = std::hash<const char *>()(tag_) % MAX_TAGS;
+        for (std::size_t i = 0; i < MAX_TAGS; ++i)
+        {
+            Slot &slot = m_slots[(start + i) % MAX_TAGS];
+            // only writers claim slots, and there is one at a time
+            const char *tag = slot.tag.load(std::memory_order_relaxed);
+            if (tag == tag_)
+            {
+                return slot;
+            }
+            if (nullptr == tag)
+            {
+                slot.text = text_;
+                slot.type_name = typeName_;
+                slot.tag.store(tag_, std::memory_order_release);
+                return slot;
+            }
+        }
+
+        return m_other;
+    }
+
+    void TaskStatsTable::Bump(Slot &slot_, std::size_t count_, int64_t wall_, int64_t cpu_, int64_t queueWait_)
+    {
+        // single writer, so no read-modify-write is needed
+        slot_.count.store(slot_.count.load(std::memory_order_relaxed) + count_, std::memory_order_relaxed);
+        slot_.wall.store(slot_.wall.load(std::memory_order_relaxed) + wall_, std::memory_order_relaxed);
+        slot_.cpu.store(slot_.cpu.load(std::memory_order_relaxed) + cpu_, std::memory_order_relaxed);
+        slot_.queue_wait.store(slot_.queue_wait.load(std::memory_order_relaxed) + queueWait_,
+                               std::memory_order_relaxed);
+    }
+
+    void TaskStatsTable::Add(const char *tag_, bool typeName_, std::chrono::nanoseconds wall_,
+                             std::chrono::nanoseconds cpu_, std::chrono::nanoseconds queueWait_)
+    {
+        Bump(Find(tag_, typeName_, tag_), 1, wall_.count(), cpu_.count(), queueWait_.count());
+    }
+
+    void TaskStatsTable::Merge(const TaskStatsTable &other_)
+    {
+        for (const Slot &slot : other_.m_slots)
+        {
+            const char *tag = slot.tag.load(std::memory_order_acquire);
+            if (nullptr != tag)
+            {
+                Bump(Find(tag, slot.type_name, slot.text.c_str()), slot.count.load(std::memory_order_relaxed),
+                     slot.wall.load(std::memory_order_relaxed), slot.cpu.load(std::memory_order_relaxed),
+                     slot.queue_wait.load(std::memory_order_relaxed));
+            }
+        }
+
+        const Slot &other = other_.m_other;
+        Bump(m_other, other.count.load(std::memory_order_relaxed), other.wall.load(std::memory_order_relaxed),
+             other.cpu.load(std::memory_order_relaxed), other.queue_wait.load(std::memory_order_relaxed));
+    }
+
+    void TaskStatsTable::MergeInto(std::unordered_map<std::string, TaskStats> &out_) const
+    {
+        std::vector<const Slot *> slots;
+        for (const Slot &slot : m_slots)
+        {
+            slots.push_back(&slot);
+        }
+        slots.push_back(&m_other);
+
+        for (const Slot *slot : slots)
+        {
+            if (nullptr == slot->tag.load(std::memory_order_acquire))
+            {
+                continue;
+            }
+            std::size_t count = slot->count.load(std::memory_order_relaxed);
+            if (0 == count)
+            {
+                continue;
+            }
+
+            TaskStats stats;
+            stats.count = count;
+            stats.wall = std::chrono::nanoseconds(slot->wall.load(std::memory_order_relaxed));
+            stats.cpu = std::chrono::nanoseconds(slot->cpu.load(std::memory_order_relaxed));
+            stats.queue_wait = std::chrono::nanoseconds(slot->queue_wait.load(std::memory_order_relaxed));
+            Accumulate(out_[slot->type_name ? Demangle(slot->text.c_str()) : slot->text], stats);
+        }
+    }
+
+    std::chrono::nanoseconds TaskStatsTable::ThreadCpuTime()
+    {
+        timespec now;
+        if (0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now))
+        {
+            return std::chrono::nanoseconds(0);
+        }
+
+        return std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec);
+    }
+
+} // levi
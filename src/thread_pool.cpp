@@ -1,10 +1,166 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <system_error>
+#include <typeinfo>
 
 
 #include "thread_pool.hpp"
+#include "bounded_channel.hpp"
+#include "cpu_quota.hpp"
 
 namespace levi
 {
+    // set by ThreadExec, lets GetWorkerContext find the calling worker
+    thread_local ThreadPool *tls_pool = nullptr;
+    thread_local WorkerThread *tls_worker = nullptr;
+    // rank of the task the worker is running, what YieldIfNeeded compares to
+    thread_local int tls_rank = 0;
+    // time of the tasks measured so far on this worker, RunTask takes the
+    // part spent in the ones YieldIfNeeded ran inline off the enclosing task
+    thread_local std::chrono::nanoseconds tls_nested_wall(0);
+    thread_local std::chrono::nanoseconds tls_nested_cpu(0);
+    // measured tasks running on this worker, inline ones are measured too
+    thread_local std::size_t tls_measured_depth = 0;
+    // affinity slot the worker owns
+    const std::size_t NO_SLOT = static_cast<std::size_t>(-1);
+    thread_local std::size_t tls_slot = NO_SLOT;
+    // how often a worker without a Parker looks for work while idle
+    const std::chrono::milliseconds PARKLESS_POLL(1);
+    // [r]: m_pushed_above[r] when YieldIfNeeded at rank r last found nothing
+    // to run. Tasks in other workers' slots or behind a control task keep
+    // m_queued_above raised, they need not be looked for again
+    thread_local std::size_t tls_yield_empty_at[ThreadPool::HIGH] = {};
+
+    // recording producer id of the calling thread, 0 until its first recorded AddTask
+    thread_local uint32_t tls_producer = 0;
+    // tasks the calling thread added while recording, the low half of their log id
+    thread_local uint32_t tls_recorded = 0;
+    std::atomic<uint32_t> g_producers(0);
+
+    // ThreadPool::m_id source
+    std::atomic<uint64_t> g_pool_ids(0);
+    // pools a producer thread keeps its shard cached for, older entries are
+    // evicted, giving their shard up, and claim one again when used
+    const std::size_t MAX_CACHED_SHARDS = 16;
+    // tasks a drain holds before publishing them to the task queue
+    const std::size_t DRAIN_BATCH = 64;
+
+    // one producer thread's ingress, one lane per Priority
+    struct ThreadPool::IngressShard
+    {
+        IngressShard() : owned(true)
+        {
+            for (std::unique_ptr<BoundedChannel<TaskEntry>> &lane : lanes)
+            {
+                lane.reset(new BoundedChannel<TaskEntry>(SHARD_LANE_CAPACITY));
+            }
+        }
+
+        std::unique_ptr<BoundedChannel<TaskEntry>> lanes[HIGH + 1];
+        // held by a producer; released with its cache entry, tasks still
+        // queued are drained as usual
+        std::atomic_bool owned;
+    };
+
+    thread_local ThreadPool::Parker *ThreadPool::tls_parker = nullptr;
+
+    // one QUEUE_WAIT worker's wake token. Wakers flip PARKED to NOTIFIED
+    // without a shared lock; the mutex only guards the sleep of its worker
+    struct ThreadPool::Parker
+    {
+        enum State
+        {
+            RUNNING,
+            PARKED,
+            NOTIFIED
+        };
+
+        Parker() : state(RUNNING), owned(true) {}
+
+        void Park()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return NOTIFIED == state.load(); });
+        }
+
+        // false when its worker is not parked
+        bool Unpark()
+        {
+            int parked = PARKED;
+            if (PARKED != state.load(std::memory_order_relaxed) ||
+                false == state.compare_exchange_strong(parked, NOTIFIED))
+            {
+                return false;
+            }
+            {
+                // a Park between its check and its wait still holds it
+                std::unique_lock<std::mutex> lock(mutex);
+            }
+            cv.notify_one();
+
+            return true;
+        }
+
+        std::atomic_int state;
+        // held by a worker; a stale pointer kept by a waker only wakes the
+        // next holder for nothing
+        std::atomic_bool owned;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    // tasks routed to one worker by their affinity key
+    struct ThreadPool::AffinitySlot
+    {
+        AffinitySlot() : size(0), owned(false), owner_idle(false), owner_parker(nullptr) {}
+
+        void Push(const TaskEntry &entry_)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue.push(entry_);
+            size.fetch_add(1);
+        }
+
+        template <typename PREDICATE>
+        bool TryPopIf(TaskEntry &out_, PREDICATE pred_)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (queue.empty() || false == pred_(queue.front()))
+            {
+                return false;
+            }
+
+            out_ = queue.front();
+            queue.pop();
+            size.fetch_sub(1);
+
+            return true;
+        }
+
+        bool Peek(TaskEntry &out_)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (queue.empty())
+            {
+                return false;
+            }
+            out_ = queue.front();
+
+            return true;
+        }
+
+        std::mutex mutex;
+        PQWrapper<TaskEntry, std::vector<TaskEntry>, CompareFunctor> queue;
+        std::atomic_size_t size;	// queue size, read without the lock
+        std::atomic_bool owned;
+        // set with release once owner_parker is PARKED, so a push can wake
+        // the owner alone
+        std::atomic_bool owner_idle;
+        std::atomic<Parker *> owner_parker;
+    };
+
 	class PauseThreadTask : public ThreadPool::ITask
 	{
 	public:
@@ -31,34 +187,127 @@ namespace levi
             std::atomic_bool &m_is_pause;
 	};
 
-    ThreadPool::ThreadPool(std::size_t threadsNum_): m_is_pause(false), m_working_thread_size(threadsNum_) 
+    // runs a DISPATCH_TASK fd callback on the pool, then rearms the fd
+    class ReactorTask : public ThreadPool::ITask
     {
+    public:
+        ReactorTask(Reactor &reactor_, Reactor::HandlerPtr handler_, uint32_t revents_) :
+            m_reactor(reactor_), m_handler(handler_), m_revents(revents_)
+        {
+            //empty
+        }
+        ~ReactorTask() = default;
+        void Execute()
+        {
+            m_reactor.Run(*m_handler, m_revents);
+        }
 
-        std::function<void(void)> thread_func = ( [this]{ ThreadExec(); });
-        for (std::size_t i = 0; i < threadsNum_; ++i)
+        ReactorTask(const ReactorTask &other_) = delete;
+        ReactorTask(const ReactorTask &&other_) = delete;
+        ReactorTask &operator=(const ReactorTask &&other_) = delete;
+        ReactorTask &operator=(const ReactorTask &other_) = delete;
+
+    private:
+        Reactor &m_reactor;
+        Reactor::HandlerPtr m_handler;
+        uint32_t m_revents;
+    };
+
+    ThreadPool::ThreadPool(std::size_t threadsNum_, SchedulingMode mode_, WaitMode wait_, std::size_t stackSize_):
+                                                                           m_is_pause(false), m_mode(mode_),
+                                                                           m_reactor(REACTOR_WAIT == wait_ ? new Reactor : nullptr),
+                                                                           m_working_thread_size(threadsNum_),
+                                                                           m_id(++g_pool_ids), m_shard_count(0), m_idle(0),
+                                                                           m_parker_count(0),
+                                                                           m_steal_threshold(DEFAULT_AFFINITY_STEAL_THRESHOLD),
+                                                                           m_stack_size(stackSize_),
+                                                                           m_pending_spawns(0),
+                                                                           m_retired_deadline_misses(0),
+                                                                           m_auto_sizing(false),
+                                                                           m_task_stats_mode(STATS_OFF),
+                                                                           m_blocked(0), m_compensating(0),
+                                                                           m_max_compensating(threadsNum_),
+                                                                           m_shutting_down(false)
+    {
+        for (std::atomic_size_t &queued : m_queued_above)
+        {
+            queued = 0;
+        }
+        for (std::atomic_size_t &pushed : m_pushed_above)
+        {
+            pushed = 0;
+        }
+        for (std::size_t i = 0; i < std::max<std::size_t>(threadsNum_, 1); ++i)
         {
-            std::shared_ptr<WorkerThread> i_thread = std::make_shared<WorkerThread>(thread_func);
-            m_map[i_thread->GetID()] = i_thread;
+            m_slots.emplace_back(new AffinitySlot);
         }
-        
+        SpawnThreadsAsync(threadsNum_);
     }
 
 
     ThreadPool::~ThreadPool() noexcept
     {
-        StopThreads(0);
-        m_map.clear();
+        // stopped after StopAll marks the pool shutting down, so a racing
+        // StartAutoSizing either is joined here or starts nothing
+        StopAll(STOP_PRIORITY);
+        StopAutoSizing();
+        {
+            std::unique_lock<std::mutex> lock(m_map_mutex);
+            m_retire_cv.wait(lock, [this]() { return m_map.empty() && 0 == m_pending_spawns; });
+        }
+        ReapRetired();
+    }
+
+    bool ThreadPool::Shutdown(ShutdownMode mode_, std::chrono::milliseconds timeout_)
+    {
+        StopAll(SHUTDOWN_DRAIN == mode_ ? DRAIN_PRIORITY : STOP_PRIORITY);
+        StopAutoSizing();
 
+        bool stopped = false;
+        {
+            std::unique_lock<std::mutex> lock(m_map_mutex);
+            stopped = m_retire_cv.wait_for(lock, timeout_, [this]() { return m_map.empty() && 0 == m_pending_spawns; });
+        }
+        ReapRetired();
+
+        return stopped;
+    }
+
+    bool ThreadPool::StopAll(int rank_)
+    {
+        std::size_t compensating = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_blocking_mutex);
+            if (m_shutting_down)
+            {
+                return false;
+            }
+            m_shutting_down = true;
+            compensating = m_compensating;
+        }
+
+        // queued before paused workers resume, so none of them can take a
+        // user task first; they must get to their stop tasks
+        StopThreads(m_working_thread_size + compensating, rank_);
+        Resume();
+
+        return true;
     }
 
     void ThreadPool::Pause()
     {
         m_is_pause = true;
         std::shared_ptr<PauseThreadTask> pause_task =  std::make_shared<PauseThreadTask>(m_mutex, m_cv, m_is_pause);;
-        TaskPriorityPair pair = {pause_task, PAUSE_PRIORITY};
-        for(std::size_t i = 0; i < m_working_thread_size; ++i)
+        TaskEntry entry(pause_task, PAUSE_PRIORITY, PAUSE_PRIORITY);
+
+        std::size_t compensating = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_blocking_mutex);
+            compensating = m_compensating;
+        }
+        for(std::size_t i = 0; i < m_working_thread_size + compensating; ++i)
         {
-            m_tasksQueue.Push(pair);
+            PushTask(entry);
         }
 
     }
@@ -69,94 +318,1124 @@ namespace levi
         m_cv.notify_all();
     }
 
-    void ThreadPool::StopThreads(size_t new_num_of_threads)
+    void ThreadPool::StopThreads(size_t num_of_threads, int rank_)
     {
-        for(std::size_t i = 0; i < m_working_thread_size - new_num_of_threads; ++i)
+        for(std::size_t i = 0; i < num_of_threads; ++i)
         {
             ITaskPtr task_ptr_stop = std::make_shared<StopThreadTask>(this);
-            TaskPriorityPair pair_stop = {task_ptr_stop, STOP_PRIORITY};  
-            m_tasksQueue.Push(pair_stop);
+            TaskEntry entry_stop(task_ptr_stop, rank_, rank_);
+            PushTask(entry_stop);
          }
     }
 
+    void ThreadPool::SpawnThreads(size_t num_of_threads)
+    {
+        std::function<void(WorkerThread&)> thread_func = ([this](WorkerThread &worker_){ ThreadExec(worker_); });
+        for (std::size_t i = 0; i < num_of_threads; ++i)
+        {
+            // created under the lock, so the worker is in the map before it can retire
+            std::unique_lock<std::mutex> lock(m_map_mutex);
+            std::shared_ptr<WorkerThread> i_thread = std::make_shared<WorkerThread>(thread_func, m_stack_size);
+            m_map[i_thread.get()] = i_thread;
+        }
+    }
+
+    void ThreadPool::SpawnThreadsAsync(size_t num_of_threads)
+    {
+        if (0 == num_of_threads)
+        {
+            return;
+        }
+
+        // one worker right away, it runs the spawn tasks for the rest
+        SpawnThreads(1);
+        if (1 < num_of_threads)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_map_mutex);
+                m_pending_spawns += num_of_threads - 1;
+            }
+            ITaskPtr task_ptr_spawn = std::make_shared<SpawnThreadTask>(this, num_of_threads - 1);
+            PushTask(TaskEntry(task_ptr_spawn, SPAWN_PRIORITY, SPAWN_PRIORITY));
+        }
+    }
+
+    void ThreadPool::Retire(WorkerThread &worker_)
+    {
+        std::unique_lock<std::mutex> lock(m_map_mutex);
+        auto worker = m_map.find(&worker_);
+        if (worker != m_map.end())
+        {
+            m_retired_deadline_misses += worker->second->GetDeadlineMisses();
+            m_retired_task_stats.Merge(worker->second->GetTaskStats());
+            m_retired.push_back(worker->second);
+            m_map.erase(worker);
+        }
+        m_retire_cv.notify_all();
+    }
+
+    void ThreadPool::ReapRetired()
+    {
+        // joined outside the lock, a retiring worker still takes it on its way out
+        std::vector<std::shared_ptr<WorkerThread>> retired;
+        {
+            std::unique_lock<std::mutex> lock(m_map_mutex);
+            retired.swap(m_retired);
+        }
+        retired.clear();
+    }
+
+
+    std::size_t ThreadPool::Auto(SizingPolicy policy_)
+    {
+        double cpus = AvailableCpus();
+        std::size_t threads = (IO_BOUND == policy_) ?
+                              static_cast<std::size_t>(std::ceil(cpus * IO_BOUND_WORKERS_PER_CPU)) :
+                              static_cast<std::size_t>(cpus);
+
+        return 0 == threads ? 1 : threads;
+    }
+
+    void ThreadPool::StartAutoSizing(SizingPolicy policy_, std::chrono::milliseconds interval_)
+    {
+        // held until the thread is stored, so a racing Start or Stop sees it
+        std::unique_lock<std::mutex> control_lock(m_auto_control_mutex);
+        JoinAutoSizer();
+        {
+            std::unique_lock<std::mutex> lock(m_blocking_mutex);
+            if (m_shutting_down)
+            {
+                return;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(m_auto_mutex);
+        m_auto_sizing = true;
+        m_auto_sizer = std::thread([this, policy_, interval_]()
+        {
+            std::size_t last = Auto(policy_);
+            std::unique_lock<std::mutex> lock(m_auto_mutex);
+            while (false == m_auto_cv.wait_for(lock, interval_, [this]() { return false == m_auto_sizing; }))
+            {
+                lock.unlock();
+                std::size_t threads = Auto(policy_);
+                if (threads != last)
+                {
+                    last = threads;
+                    SetNumOfThreads(threads);
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    void ThreadPool::StopAutoSizing()
+    {
+        std::unique_lock<std::mutex> control_lock(m_auto_control_mutex);
+        JoinAutoSizer();
+    }
+
+    void ThreadPool::JoinAutoSizer()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_auto_mutex);
+            m_auto_sizing = false;
+        }
+        m_auto_cv.notify_all();
+
+        if (m_auto_sizer.joinable())
+        {
+            m_auto_sizer.join();
+        }
+    }
 
     void ThreadPool::SetNumOfThreads(std::size_t newThreadsNum_)
     {   
-        if(m_working_thread_size > newThreadsNum_)
+        std::unique_lock<std::mutex> resize_lock(m_resize_mutex);
+        ReapRetired();
         {
-            StopThreads(newThreadsNum_);
-            
-            for(std::size_t i = 0; i < m_working_thread_size - newThreadsNum_; ++i)
+            std::unique_lock<std::mutex> lock(m_blocking_mutex);
+            if (m_shutting_down)
             {
-                ITaskPtr task_ptr_kill = std::make_shared<KillThreadTask>(this);
-                TaskPriorityPair pair_kill = {task_ptr_kill, KILL_PRIORITY};
-                m_tasksQueue.Push(pair_kill);
+                return;
             }
         }
 
+        if(m_working_thread_size > newThreadsNum_)
+        {
+            StopThreads(m_working_thread_size - newThreadsNum_, STOP_PRIORITY);
+        }
+
         else if((m_working_thread_size < newThreadsNum_))
         {
-            std::function<void()> thread_func = ([this](){ ThreadExec(); });
-            for (std::size_t i = 0; i < newThreadsNum_ - m_working_thread_size; ++i)
+            SpawnThreadsAsync(newThreadsNum_ - m_working_thread_size);
+        }
+        m_working_thread_size = newThreadsNum_;
+    }
+
+    std::size_t ThreadPool::GetNumOfThreads() const
+    {
+        std::unique_lock<std::mutex> lock(m_map_mutex);
+
+        return m_map.size();
+    }
+
+    void ThreadPool::SetMaxCompensatingThreads(std::size_t max_)
+    {
+        std::unique_lock<std::mutex> lock(m_blocking_mutex);
+        m_max_compensating = max_;
+    }
+
+    void ThreadPool::EnterBlocking()
+    {
+        std::unique_lock<std::mutex> lock(m_blocking_mutex);
+        ++m_blocked;
+        if (m_shutting_down || m_compensating >= m_blocked || m_compensating >= m_max_compensating)
+        {
+            return;
+        }
+
+        try
+        {
+            SpawnThreads(1);
+        }
+        catch (...)
+        {
+            // the scope throws, so no ExitBlocking will undo the ++m_blocked
+            --m_blocked;
+            throw;
+        }
+        ++m_compensating;
+    }
+
+    void ThreadPool::ExitBlocking()
+    {
+        std::unique_lock<std::mutex> lock(m_blocking_mutex);
+        --m_blocked;
+        if (m_shutting_down || m_compensating <= m_blocked)
+        {
+            return;
+        }
+
+        // whichever worker takes the stop task retires, the pool size is what counts
+        --m_compensating;
+        StopThreads(1, STOP_PRIORITY);
+    }
+
+    // nesting depth of BlockingScope on this thread, only the outermost counts
+    thread_local std::size_t tls_blocking_depth = 0;
+
+    ThreadPool::BlockingScope::BlockingScope() : m_pool(tls_pool)
+    {
+        if (nullptr != m_pool && 0 == tls_blocking_depth++)
+        {
+            try
+            {
+                m_pool->EnterBlocking();
+            }
+            catch (...)
             {
-                std::shared_ptr<WorkerThread> i_thread = std::make_shared<WorkerThread>(thread_func);
-                m_map[i_thread->GetID()] = i_thread;
+                --tls_blocking_depth;
+                throw;
             }
-        
         }
-        m_working_thread_size = newThreadsNum_;
+    }
+
+    ThreadPool::BlockingScope::~BlockingScope() noexcept
+    {
+        if (nullptr != m_pool && 0 == --tls_blocking_depth)
+        {
+            m_pool->ExitBlocking();
+        }
     }
 
     void ThreadPool::AddTask(std::shared_ptr<ITask> p_task_, Priority priority_)
     {
-        TaskPriorityPair pair = {p_task_, priority_};
-        m_tasksQueue.Push(pair);
+        AddTask(p_task_, TimePoint::max(), priority_);
     }
 
-    void ThreadPool::ThreadExec()
+    void ThreadPool::AddTask(std::shared_ptr<ITask> p_task_, TimePoint deadline_, Priority priority_)
     {
-        
-        TaskPriorityPair pair;
+        TaskEntry entry = UserEntry(p_task_, deadline_, priority_);
+        const int rank = entry.rank;
 
-        while(1)
+        IngressShard *shard = LocalShard();
+        // TryPush moves only on success
+        if (nullptr == shard || false == shard->lanes[rank]->TryPush(std::move(entry)))
         {
-            m_tasksQueue.Pop(pair);
+            PushTask(entry);
+            return;
+        }
+        WakeIdle();
+    }
+
+    void ThreadPool::AddTask(std::shared_ptr<ITask> p_task_, Priority priority_, std::size_t affinityKey_)
+    {
+        std::size_t slot = affinityKey_ % m_slots.size();
+        TaskEntry entry = UserEntry(p_task_, TimePoint::max(), priority_);
+        // counted before the push, so the worker that pops it never underflows
+        CountQueued(entry.rank, 1);
+        m_slots[slot]->Push(entry);
+        WakeAffinity(slot);
+    }
 
-            pair.first->Execute();
-            if(pair.second == STOP_PRIORITY) 
+    void ThreadPool::SetAffinityStealThreshold(std::size_t queued_)
+    {
+        m_steal_threshold.store(queued_, std::memory_order_relaxed);
+    }
+
+    ThreadPool::TaskEntry ThreadPool::UserEntry(ITaskPtr task_, TimePoint deadline_, Priority priority_)
+    {
+        // in EDF mode all user tasks share one rank, so the deadline decides
+        int rank = (EDF_MODE == m_mode) ? static_cast<int>(NORMAL) : static_cast<int>(priority_);
+        TaskEntry entry(task_, rank, priority_, deadline_);
+        if (m_recorder.IsRecording())
+        {
+            if (0 == tls_producer)
             {
-                break;
+                tls_producer = ++g_producers;
             }
-            
+            entry.record_id = (static_cast<uint64_t>(tls_producer) << 32) | ++tls_recorded;
+            entry.enqueued = Clock::now();
+            // logged here, not when run, so cancelled and dropped tasks are in the trace too
+            m_recorder.AppendSubmit(entry.record_id, entry.enqueued, tls_producer, priority_);
+        }
+        else if (STATS_OFF != m_task_stats_mode.load(std::memory_order_relaxed))
+        {
+            entry.enqueued = Clock::now();
         }
 
+        return entry;
     }
 
-    ThreadPool::StopThreadTask::StopThreadTask(ThreadPool *pool) : m_pool(pool)
+    void ThreadPool::ClaimParker()
     {
-        //Empty
+        if (m_reactor)
+        {
+            return; // reactor workers block in epoll
+        }
+
+        std::unique_lock<std::mutex> lock(m_parker_mutex);
+        std::size_t count = m_parker_count.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (false == m_parkers[i]->owned.exchange(true))
+            {
+                tls_parker = m_parkers[i].get();
+                return;
+            }
+        }
+        if (count < MAX_PARKERS)
+        {
+            m_parkers[count].reset(new Parker);
+            tls_parker = m_parkers[count].get();
+            m_parker_count.store(count + 1, std::memory_order_release);
+        }
     }
 
-    void ThreadPool::StopThreadTask::Execute()
+    void ThreadPool::ReleaseParker()
+    {
+        if (nullptr != tls_parker)
+        {
+            tls_parker->owned.store(false);
+            tls_parker = nullptr;
+        }
+    }
+
+    void ThreadPool::ClaimSlot()
+    {
+        std::unique_lock<std::mutex> lock(m_slot_mutex);
+        for (std::size_t i = 0; i < m_slots.size(); ++i)
+        {
+            if (false == m_slots[i]->owned)
+            {
+                m_slots[i]->owned = true;
+                m_slots[i]->owner_parker.store(tls_parker);
+                tls_slot = i;
+                return;
+            }
+        }
+    }
+
+    void ThreadPool::ReleaseSlot()
+    {
+        if (NO_SLOT == tls_slot)
+        {
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m_slot_mutex);
+            m_slots[tls_slot]->owned = false;
+            m_slots[tls_slot]->owner_parker.store(nullptr);
+        }
+        // its tasks are anyone's now
+        if (0 != m_slots[tls_slot]->size)
+        {
+            WakeAffinity(tls_slot);
+        }
+        tls_slot = NO_SLOT;
+    }
+
+    bool ThreadPool::IsStealable(std::size_t slot_, std::size_t threshold_) const
     {
-        m_pool->m_wq_threads_id.Push(std::this_thread::get_id()); 
+        const AffinitySlot &slot = *m_slots[slot_];
+        std::size_t size = slot.size.load();
+        if (slot_ == tls_slot || false == slot.owned)
+        {
+            return 0 != size;
+        }
+
+        return size > threshold_;
     }
 
+    bool ThreadPool::PopOwnSlot(TaskEntry &entry_)
+    {
+        if (NO_SLOT == tls_slot || 0 == m_slots[tls_slot]->size.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        AffinitySlot &slot = *m_slots[tls_slot];
+        TaskEntry local;
+        if (false == slot.Peek(local))
+        {
+            return false;
+        }
+
+        // a shared task ranked above it, control tasks included, goes first
+        CompareFunctor less;
+        if (m_tasksQueue.TryPopIf(entry_, [&less, &local](const TaskEntry &front) { return less(local, front); }))
+        {
+            return true;
+        }
+
+        return slot.TryPopIf(entry_, [](const TaskEntry &) { return true; });
+    }
 
-    ThreadPool::KillThreadTask::KillThreadTask(ThreadPool *pool) : m_pool(pool)
+    bool ThreadPool::PopAffinity(TaskEntry &entry_, std::size_t threshold_)
     {
+        // own slot first, then the others round-robin from the next one
+        std::size_t start = (NO_SLOT == tls_slot) ? 0 : tls_slot;
+        for (std::size_t i = 0; i < m_slots.size(); ++i)
+        {
+            std::size_t slot = (start + i) % m_slots.size();
+            if (IsStealable(slot, threshold_) &&
+                m_slots[slot]->TryPopIf(entry_, [](const TaskEntry &) { return true; }))
+            {
+                return true;
+            }
+        }
+
+        return false;
     }
 
-    void ThreadPool::KillThreadTask::Execute()
+    bool ThreadPool::HasAffinityWork() const
     {
-        std::thread::id threadId;
-        m_pool->m_wq_threads_id.Pop(threadId);
-        m_pool->m_map.erase(threadId);
+        std::size_t threshold = m_steal_threshold.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < m_slots.size(); ++i)
+        {
+            if (IsStealable(i, threshold))
+            {
+                return true;
+            }
+        }
+
+        return false;
     }
 
-    bool ThreadPool::CompareFunctor::operator()(const TaskPriorityPair &p1, TaskPriorityPair &p2) const
+    void ThreadPool::WakeAffinity(std::size_t slot_)
     {
-        return (p1.second < p2.second); 
+        // pairs with the owner_idle / m_idle increments of workers that then
+        // check the slots: either they see the task, or this sees them idle
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        AffinitySlot &slot = *m_slots[slot_];
+        bool owned = slot.owned.load(std::memory_order_relaxed);
+        // acquire: an idle owner's parker is seen PARKED
+        bool owner_idle = owned && slot.owner_idle.load(std::memory_order_acquire);
+        // past the threshold (or unowned) any worker may take it
+        bool stealable = (false == owned) ||
+                         slot.size.load(std::memory_order_relaxed) > m_steal_threshold.load(std::memory_order_relaxed);
+
+        if (m_reactor)
+        {
+            // epoll cannot pick a worker, so an idle owner needs them all
+            if (owner_idle)
+            {
+                WakeIdle(m_idle.load(std::memory_order_relaxed));
+            }
+            else if (stealable)
+            {
+                WakeIdle();
+            }
+            return;
+        }
+
+        Parker *owner = slot.owner_parker.load();
+        if (owner_idle && nullptr != owner)
+        {
+            owner->Unpark();
+        }
+        if (stealable)
+        {
+            WakeIdle(); // one thief
+        }
+    }
+
+    ThreadPool::IngressShard *ThreadPool::LocalShard()
+    {
+        typedef std::pair<uint64_t, std::shared_ptr<IngressShard>> Entry;
+        // gives the shards up when the thread exits; sharing ownership keeps
+        // that safe for pools already destroyed
+        struct Cache
+        {
+            ~Cache()
+            {
+                for (Entry &entry : entries)
+                {
+                    Release(entry);
+                }
+            }
+
+            static void Release(Entry &entry_)
+            {
+                if (entry_.second)
+                {
+                    entry_.second->owned.store(false, std::memory_order_release);
+                }
+            }
+
+            std::vector<Entry> entries;
+        };
+        static thread_local Cache cache;
+
+        for (const Entry &cached : cache.entries)
+        {
+            if (cached.first == m_id)
+            {
+                return cached.second.get();
+            }
+        }
+
+        // a free shard first, a new one while there is room, nullptr once
+        // the pool is out of shards; cached too so this lock is taken once
+        // per producer
+        std::shared_ptr<IngressShard> shard;
+        {
+            std::unique_lock<std::mutex> lock(m_shard_mutex);
+            std::size_t count = m_shard_count.load(std::memory_order_relaxed);
+            for (std::size_t i = 0; i < count && !shard; ++i)
+            {
+                if (false == m_shards[i]->owned.exchange(true, std::memory_order_acq_rel))
+                {
+                    shard = m_shards[i];
+                }
+            }
+            if (!shard && count < MAX_SHARDS)
+            {
+                m_shards[count] = std::make_shared<IngressShard>();
+                shard = m_shards[count];
+                m_shard_count.store(count + 1, std::memory_order_release);
+            }
+        }
+
+        if (MAX_CACHED_SHARDS == cache.entries.size())
+        {
+            Cache::Release(cache.entries.front());
+            cache.entries.erase(cache.entries.begin());
+        }
+        cache.entries.push_back(Entry(m_id, shard));
+
+        return shard.get();
+    }
+
+    bool ThreadPool::HasIngress(int above_) const
+    {
+        std::size_t count = m_shard_count.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            for (int rank = above_ + 1; rank <= HIGH; ++rank)
+            {
+                if (false == m_shards[i]->lanes[rank]->IsEmpty())
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    bool ThreadPool::DrainIngress()
+    {
+        // reused, so draining allocates only while the batch grows
+        static thread_local std::vector<TaskEntry> batch;
+        // shard the next drain starts at, so no producer is always served last
+        static thread_local std::size_t cursor = 0;
+
+        // rank by rank across the shards and published every DRAIN_BATCH
+        // tasks, so no task waits in this worker's hands behind lower ranked
+        // ones while the other workers cannot see it
+        std::size_t count = m_shard_count.load(std::memory_order_acquire);
+        std::size_t moved = 0;
+        TaskEntry entry;
+        for (int rank = HIGH; rank >= LOW; --rank)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                BoundedChannel<TaskEntry> &lane = *m_shards[(cursor + i) % count]->lanes[rank];
+                // bounded, a busy producer cannot keep the worker here
+                for (std::size_t n = 0; n < SHARD_LANE_CAPACITY && lane.TryPop(entry); ++n)
+                {
+                    batch.push_back(std::move(entry));
+                    if (DRAIN_BATCH == batch.size())
+                    {
+                        moved += PublishIngress(batch, rank);
+                    }
+                }
+            }
+            moved += PublishIngress(batch, rank);
+        }
+        ++cursor;
+
+        return 0 != moved;
+    }
+
+    std::size_t ThreadPool::PublishIngress(std::vector<TaskEntry> &batch_, int rank_)
+    {
+        std::size_t moved = batch_.size();
+        if (0 == moved)
+        {
+            return 0;
+        }
+
+        // counted here rather than by producers, once per batch
+        CountQueued(rank_, static_cast<int>(moved));
+        m_tasksQueue.PushAll(batch_);
+        WakeIdle(moved);
+
+        return moved;
+    }
+
+    void ThreadPool::WakeIdle(std::size_t count_)
+    {
+        // pairs with the m_idle increment of a worker that then checks the
+        // queue and shards: either it sees this task, or this sees it idle,
+        // and with acquire its parker PARKED
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::size_t idle = m_idle.load(std::memory_order_acquire);
+        if (0 == idle)
+        {
+            return;
+        }
+
+        if (m_reactor)
+        {
+            // semaphore tokens outlive the wait, so no more than can be taken
+            m_reactor->Notify(std::min(count_, idle));
+            return;
+        }
+
+        // from a moving start, so wakers do not all probe the same parkers
+        static thread_local std::size_t cursor = 0;
+        std::size_t parkers = m_parker_count.load(std::memory_order_acquire);
+        ++cursor;
+        for (std::size_t i = 0; i < parkers && 0 != count_; ++i)
+        {
+            if (m_parkers[(cursor + i) % parkers]->Unpark())
+            {
+                --count_;
+            }
+        }
+    }
+
+    void ThreadPool::CountQueued(int rank_, int delta_)
+    {
+        if (rank_ > HIGH)
+        {
+            return; // control tasks are not counted
+        }
+
+        for (int rank = LOW; rank < rank_; ++rank)
+        {
+            m_queued_above[rank].fetch_add(delta_, std::memory_order_relaxed);
+            if (0 < delta_)
+            {
+                m_pushed_above[rank].fetch_add(delta_, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool ThreadPool::YieldIfNeeded()
+    {
+        ThreadPool *pool = tls_pool;
+        if (nullptr == pool || tls_rank >= HIGH)
+        {
+            return false;
+        }
+
+        const int rank = tls_rank;
+        // shards are not counted until drained, so their lanes are looked at
+        bool ingress = pool->HasIngress(rank);
+        if (false == ingress && 0 == pool->m_queued_above[rank].load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        // read before looking, so a task pushed meanwhile is looked for next time
+        std::size_t pushed = pool->m_pushed_above[rank].load(std::memory_order_relaxed);
+        if (false == ingress && pushed == tls_yield_empty_at[rank])
+        {
+            return false;
+        }
+
+        bool yielded = false;
+        pool->DrainIngress();
+
+        TaskEntry entry;
+        // control tasks rank above HIGH and stay queued for the worker loop
+        auto above = [rank](const TaskEntry &e) { return e.rank > rank && e.rank <= HIGH; };
+        while (pool->m_tasksQueue.TryPopIf(entry, above) ||
+               (NO_SLOT != tls_slot && pool->m_slots[tls_slot]->TryPopIf(entry, above)))
+        {
+            pool->CountQueued(entry.rank, -1);
+            yielded = true;
+            if (pool->IsExpired(entry, *tls_worker))
+            {
+                continue;
+            }
+
+            tls_rank = entry.rank;
+            pool->RunTask(entry, *tls_worker);
+            tls_rank = rank;
+        }
+
+        if (false == yielded)
+        {
+            tls_yield_empty_at[rank] = pushed;
+        }
+
+        return yielded;
+    }
+
+    bool ThreadPool::StartRecording(const std::string &path_)
+    {
+        return m_recorder.Start(path_);
+    }
+
+    void ThreadPool::StopRecording()
+    {
+        m_recorder.Stop();
+        {
+            std::unique_lock<std::mutex> lock(m_map_mutex);
+            for (const auto &worker : m_map)
+            {
+                m_recorder.Flush(worker.second->GetRecordBuffer());
+            }
+        }
+        m_recorder.Close();
+    }
+
+    void ThreadPool::SetTaskStats(TaskStatsMode mode_)
+    {
+        m_task_stats_mode.store(mode_, std::memory_order_relaxed);
+    }
+
+    std::unordered_map<std::string, TaskStats> ThreadPool::GetTaskStats() const
+    {
+        // retired and live tables are read under one lock, Retire moves a
+        // worker between them
+        std::unordered_map<std::string, TaskStats> stats;
+        std::unique_lock<std::mutex> lock(m_map_mutex);
+        m_retired_task_stats.MergeInto(stats);
+        for (const auto &worker : m_map)
+        {
+            worker.second->GetTaskStats().MergeInto(stats);
+        }
+
+        return stats;
+    }
+
+    void ThreadPool::Watch(int fd_, uint32_t events_, std::function<void(uint32_t)> callback_,
+                           DispatchMode dispatch_, Priority priority_)
+    {
+        if (!m_reactor)
+        {
+            throw std::logic_error("ThreadPool::Watch requires REACTOR_WAIT");
+        }
+
+        Reactor::HandlerPtr handler(new Reactor::Handler{fd_, events_, callback_, DISPATCH_INLINE == dispatch_, priority_});
+        m_reactor->Watch(handler);
+    }
+
+    void ThreadPool::Unwatch(int fd_)
+    {
+        if (m_reactor)
+        {
+            m_reactor->Unwatch(fd_);
+        }
+    }
+
+    void ThreadPool::PushTask(const TaskEntry &entry_)
+    {
+        // counted before the push, so the worker that pops it never underflows
+        CountQueued(entry_.rank, 1);
+        m_tasksQueue.Push(entry_);
+        WakeIdle();
+    }
+
+    void ThreadPool::NextTask(TaskEntry &entry_)
+    {
+        while (true)
+        {
+            DrainIngress();
+            PopTask(entry_);
+            if (DRAIN_PRIORITY != entry_.rank)
+            {
+                return;
+            }
+
+            // tasks still in the shards or slots were added before the drain
+            // stop, it goes back behind them
+            TaskEntry queued;
+            if (DrainIngress())
+            {
+                PushTask(entry_);
+                continue;
+            }
+            if (PopAffinity(queued, 0))
+            {
+                PushTask(entry_);
+                entry_ = queued;
+            }
+            return;
+        }
+    }
+
+    void ThreadPool::PopTask(TaskEntry &entry_)
+    {
+        if (PopOwnSlot(entry_))
+        {
+            return;
+        }
+
+        AffinitySlot *own = (NO_SLOT == tls_slot) ? nullptr : m_slots[tls_slot].get();
+        Parker *parker = tls_parker;
+        while (false == m_tasksQueue.TryPop(entry_))
+        {
+            if (PopAffinity(entry_, m_steal_threshold.load(std::memory_order_relaxed)))
+            {
+                return;
+            }
+
+            // PARKED, then counted idle, then the owner flag: a waker that
+            // sees either count or flag also sees the parker PARKED
+            uint32_t revents = 0;
+            Reactor::HandlerPtr handler;
+            if (nullptr != parker)
+            {
+                parker->state.store(Parker::PARKED);
+            }
+            m_idle.fetch_add(1);
+            if (nullptr != own)
+            {
+                own->owner_idle.store(true, std::memory_order_release);
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // a push that saw no idle worker did not wake one, recheck
+            if (m_tasksQueue.IsEmpty() && false == HasIngress() && false == HasAffinityWork())
+            {
+                if (m_reactor)
+                {
+                    handler = m_reactor->Wait(revents);
+                }
+                else if (nullptr != parker)
+                {
+                    parker->Park();
+                }
+                else
+                {
+                    std::this_thread::sleep_for(PARKLESS_POLL);
+                }
+            }
+            if (nullptr != own)
+            {
+                own->owner_idle.store(false, std::memory_order_relaxed);
+            }
+            m_idle.fetch_sub(1);
+            if (nullptr != parker)
+            {
+                parker->state.store(Parker::RUNNING);
+            }
+
+            if (!handler)
+            {
+                DrainIngress();
+                continue;
+            }
+
+            if (handler->run_inline)
+            {
+                m_reactor->Run(*handler, revents);
+            }
+            else
+            {
+                AddTask(std::make_shared<ReactorTask>(*m_reactor, handler, revents),
+                        static_cast<Priority>(handler->priority));
+            }
+        }
+    }
+
+    void ThreadPool::SetDeadlineMissHandler(std::function<void(std::shared_ptr<ITask>)> handler_)
+    {
+        std::unique_lock<std::mutex> lock(m_handler_mutex);
+        m_deadline_miss_handler = handler_;
+    }
+
+    std::size_t ThreadPool::GetDeadlineMisses() const
+    {
+        std::size_t misses = m_retired_deadline_misses;
+
+        std::unique_lock<std::mutex> lock(m_map_mutex);
+        for (const auto &worker : m_map)
+        {
+            misses += worker.second->GetDeadlineMisses();
+        }
+
+        return misses;
+    }
+
+    std::unordered_map<std::thread::id, std::size_t> ThreadPool::GetDeadlineMissesPerWorker() const
+    {
+        std::unordered_map<std::thread::id, std::size_t> misses;
+
+        std::unique_lock<std::mutex> lock(m_map_mutex);
+        for (const auto &worker : m_map)
+        {
+            misses[worker.second->GetID()] = worker.second->GetDeadlineMisses();
+        }
+
+        return misses;
+    }
+
+    std::size_t ThreadPool::RegisterContextFactory(std::function<std::shared_ptr<void>()> factory_)
+    {
+        std::unique_lock<std::mutex> lock(m_context_mutex);
+        m_context_factories.push_back(factory_);
+
+        return m_context_factories.size() - 1;
+    }
+
+    void *ThreadPool::GetContext(uint64_t pool_, std::size_t index_)
+    {
+        // a key indexes its own pool's factories, another pool's index could
+        // name a context of a different type
+        if (nullptr == tls_worker || tls_pool->m_id != pool_)
+        {
+            return nullptr;
+        }
+
+        std::shared_ptr<void> &context = tls_worker->Context(index_);
+        if (!context)
+        {
+            std::function<std::shared_ptr<void>()> factory;
+            {
+                std::unique_lock<std::mutex> lock(tls_pool->m_context_mutex);
+                if (index_ >= tls_pool->m_context_factories.size())
+                {
+                    return nullptr;
+                }
+                factory = tls_pool->m_context_factories[index_];
+            }
+            context = factory();
+        }
+
+        return context.get();
+    }
+
+    bool ThreadPool::IsExpired(const TaskEntry &entry_, WorkerThread &worker_)
+    {
+        if (entry_.deadline == TimePoint::max() || entry_.rank > HIGH || Clock::now() <= entry_.deadline)
+        {
+            return false;
+        }
+
+        worker_.IncDeadlineMisses();
+
+        std::function<void(ITaskPtr)> handler;
+        {
+            std::unique_lock<std::mutex> lock(m_handler_mutex);
+            handler = m_deadline_miss_handler;
+        }
+
+        if (handler)
+        {
+            handler(entry_.task);
+        }
+
+        return true;
+    }
+
+    void ThreadPool::RunTask(const TaskEntry &entry_, WorkerThread &worker_)
+    {
+        // control tasks are never accounted
+        int stats_mode = (LOW <= entry_.rank && entry_.rank <= HIGH) ?
+                         m_task_stats_mode.load(std::memory_order_relaxed) : STATS_OFF;
+        if (0 == entry_.record_id && STATS_OFF == stats_mode && 0 == tls_measured_depth)
+        {
+            entry_.task->Execute();
+            return;
+        }
+
+        const std::chrono::nanoseconds nested_wall = tls_nested_wall;
+        const std::chrono::nanoseconds nested_cpu = tls_nested_cpu;
+        std::chrono::nanoseconds cpu_start(0);
+        if (STATS_CPU == stats_mode)
+        {
+            cpu_start = TaskStatsTable::ThreadCpuTime();
+        }
+        TimePoint start = Clock::now();
+        ++tls_measured_depth;
+        entry_.task->Execute();
+        --tls_measured_depth;
+        TimePoint end = Clock::now();
+        std::chrono::nanoseconds wall = end - start;
+        std::chrono::nanoseconds cpu(0);
+        if (STATS_CPU == stats_mode)
+        {
+            cpu = TaskStatsTable::ThreadCpuTime() - cpu_start;
+        }
+
+        // tasks YieldIfNeeded ran inline charged themselves; the enclosing
+        // task, if any, is charged all of this one
+        std::chrono::nanoseconds own_wall = wall - (tls_nested_wall - nested_wall);
+        std::chrono::nanoseconds own_cpu = std::max(cpu - (tls_nested_cpu - nested_cpu), std::chrono::nanoseconds(0));
+        tls_nested_wall = nested_wall + wall;
+        tls_nested_cpu = nested_cpu + cpu;
+
+        if (0 != entry_.record_id)
+        {
+            m_recorder.AppendComplete(worker_.GetRecordBuffer(), entry_.record_id, own_wall);
+        }
+
+        if (STATS_OFF != stats_mode)
+        {
+            const char *tag = entry_.task->GetTypeTag();
+            bool type_name = (nullptr == tag);
+            if (type_name)
+            {
+                tag = typeid(*entry_.task).name();
+            }
+
+            // tasks added before accounting was enabled carry no enqueue time
+            TimePoint enqueued = (TimePoint() == entry_.enqueued) ? start : entry_.enqueued;
+            worker_.GetTaskStats().Add(tag, type_name, own_wall, own_cpu, start - enqueued);
+        }
+    }
+
+    void ThreadPool::ThreadExec(WorkerThread &worker_)
+    {
+        tls_pool = this;
+        tls_worker = &worker_;
+        ClaimParker();
+        ClaimSlot();
+
+        TaskEntry entry;
+
+        while(1)
+        {
+            NextTask(entry);
+            CountQueued(entry.rank, -1);
+
+            if (IsExpired(entry, worker_))
+            {
+                continue;
+            }
+
+            tls_rank = entry.rank;
+            RunTask(entry, worker_);
+            if(entry.rank == STOP_PRIORITY || entry.rank == DRAIN_PRIORITY)
+            {
+                break;
+            }
+            
+        }
+
+        ReleaseSlot();
+        ReleaseParker();
+        // retiring worker destroys its contexts on its own thread
+        worker_.ClearContexts();
+        m_recorder.Flush(worker_.GetRecordBuffer());
+        tls_worker = nullptr;
+        tls_pool = nullptr;
+    }
+
+    ThreadPool::StopThreadTask::StopThreadTask(ThreadPool *pool) : m_pool(pool)
+    {
+        //Empty
+    }
+
+    void ThreadPool::StopThreadTask::Execute()
+    {
+        m_pool->Retire(*tls_worker);
+    }
+
+    ThreadPool::SpawnThreadTask::SpawnThreadTask(ThreadPool *pool, std::size_t count) : m_pool(pool), m_count(count)
+    {
+        //Empty
+    }
+
+    void ThreadPool::SpawnThreadTask::Execute()
+    {
+        // split the rest first, so idle workers spawn alongside this one
+        std::size_t rest = m_count - 1;
+        std::size_t halves[2] = {rest - rest / 2, rest / 2};
+        for (std::size_t half : halves)
+        {
+            if (0 != half)
+            {
+                ITaskPtr task_ptr_spawn = std::make_shared<SpawnThreadTask>(m_pool, half);
+                m_pool->PushTask(TaskEntry(task_ptr_spawn, m_pool->SPAWN_PRIORITY, m_pool->SPAWN_PRIORITY));
+            }
+        }
+
+        try
+        {
+            m_pool->SpawnThreads(1);
+        }
+        catch (const std::system_error &)
+        {
+            // out of threads, the pool runs with fewer workers
+        }
+
+        std::unique_lock<std::mutex> lock(m_pool->m_map_mutex);
+        --m_pool->m_pending_spawns;
+        m_pool->m_retire_cv.notify_all();
+    }
+
+    ThreadPool::TaskEntry::TaskEntry() : rank(0), priority(0), deadline(TimePoint::max()), record_id(0)
+    {
+    }
+
+    ThreadPool::TaskEntry::TaskEntry(ITaskPtr task_, int rank_, int priority_, TimePoint deadline_) :
+        task(task_), rank(rank_), priority(priority_), deadline(deadline_), record_id(0)
+    {
+    }
+
+    bool ThreadPool::CompareFunctor::operator()(const TaskEntry &e1, const TaskEntry &e2) const
+    {
+        if (e1.rank != e2.rank)
+        {
+            return (e1.rank < e2.rank);
+        }
+
+        // later deadline is "less", so the earliest deadline reaches the top
+        if (e1.deadline != e2.deadline)
+        {
+            return (e1.deadline > e2.deadline);
+        }
+
+        return (e1.priority < e2.priority);
     }
 
 
@@ -4,12 +4,34 @@
 #include <thread>
 #include <functional>
 #include <set>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 #define RED     "\033[31m"      /* Red */
 #define GREEN   "\033[32m"      /* Green */
 #define RESET   "\033[0m"
 
 #include "thread_pool.hpp"
+#include "async_file_io.hpp"
+#include "pipeline.hpp"
+#include "shm_task_queue.hpp"
+#include "when_all.hpp"
+#include "cpu_quota.hpp"
+#include "basic_thread_pool.hpp"
 
 template<typename T>
 static std::string Str(const T& d)
@@ -119,8 +141,1614 @@ private:
 
 
 
+class RecordTask : public ThreadPool::ITask
+{
+public:
+    RecordTask(std::vector<int> &record_, int id_) : m_record(record_), m_id(id_) { }
+
+    virtual void Execute()
+    {
+        std::unique_lock<std::mutex> lock(MUTEX);
+        m_record.push_back(m_id);
+    }
+private:
+    std::vector<int> &m_record;
+    int m_id;
+};
+
+
+static void WaitForRecord(const std::vector<int> &record_, size_t size_)
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(MUTEX);
+            if (record_.size() >= size_)
+            {
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+
+
+
+static void TestDeadlineScheduling()
+{
+    std::vector<int> record;
+    std::atomic_size_t handled(0);
+    ThreadPool pool(1, ThreadPool::EDF_MODE);
+    pool.Pause();
+
+    // added with latest deadline first, must run with earliest deadline first
+    const int TASKS = 50;
+    ThreadPool::TimePoint now = ThreadPool::Clock::now();
+    for (int i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, TASKS - 1 - i),
+                     now + std::chrono::seconds(60) - std::chrono::milliseconds(i),
+                     (i % 2) ? ThreadPool::HIGH : ThreadPool::LOW);
+    }
+
+    // already late, must be routed to the handler instead of running
+    pool.SetDeadlineMissHandler([&handled](std::shared_ptr<ThreadPool::ITask>) { ++handled; });
+    pool.AddTask(std::make_shared<RecordTask>(record, -1), now - std::chrono::milliseconds(1));
+
+    pool.Resume();
+    WaitForRecord(record, TASKS);
+    while (0 == handled)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::unique_lock<std::mutex> lock(MUTEX);
+    for (int i = 0; i < TASKS; ++i)
+    {
+        if (i != record[i])
+        {
+            throw Error("EDF mode did not run earliest deadline first",
+                        Str(i), Str(record[i]), __LINE__, i);
+        }
+    }
+
+    if (1 != pool.GetDeadlineMisses() || static_cast<size_t>(TASKS) != record.size())
+    {
+        throw Error("Expired task was not dropped and counted",
+                    Str(1), Str(pool.GetDeadlineMisses()), __LINE__);
+    }
+
+    std::cout << GREEN << "Pool in EDF mode passed deadline tests" << RESET << std::endl;
+}
+
+
+
+
+std::atomic_int contextsAlive(0);
+std::atomic_int contextsBuilt(0);
+
+struct ScratchContext
+{
+    ScratchContext() : uses(0) { ++contextsAlive; ++contextsBuilt; }
+    ~ScratchContext() { --contextsAlive; }
+
+    size_t uses;
+};
+
+
+class ScratchTask : public ThreadPool::ITask
+{
+public:
+    ScratchTask(ThreadPool::ContextKey<ScratchContext> key_, std::vector<int> &record_) :
+        m_key(key_), m_record(record_) { }
+
+    virtual void Execute()
+    {
+        ScratchContext *context = ThreadPool::GetWorkerContext(m_key);
+        ++context->uses;
+
+        std::unique_lock<std::mutex> lock(MUTEX);
+        m_record.push_back(static_cast<int>(context->uses));
+    }
+private:
+    ThreadPool::ContextKey<ScratchContext> m_key;
+    std::vector<int> &m_record;
+};
+
+// builds its worker's context, then holds the worker until count_ arrived
+class ScratchBarrierTask : public ThreadPool::ITask
+{
+public:
+    ScratchBarrierTask(ThreadPool::ContextKey<ScratchContext> key_, std::atomic_size_t &arrived_, size_t count_) :
+        m_key(key_), m_arrived(arrived_), m_count(count_) { }
+
+    virtual void Execute()
+    {
+        ThreadPool::GetWorkerContext(m_key);
+        ++m_arrived;
+        while (m_arrived < m_count)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+private:
+    ThreadPool::ContextKey<ScratchContext> m_key;
+    std::atomic_size_t &m_arrived;
+    size_t m_count;
+};
+
+// reports whether key_ resolved on a worker of another pool
+class ForeignKeyTask : public ThreadPool::ITask
+{
+public:
+    ForeignKeyTask(ThreadPool::ContextKey<ScratchContext> key_, std::vector<int> &record_) :
+        m_key(key_), m_record(record_) { }
+
+    virtual void Execute()
+    {
+        int resolved = (nullptr != ThreadPool::GetWorkerContext(m_key));
+
+        std::unique_lock<std::mutex> lock(MUTEX);
+        m_record.push_back(resolved);
+    }
+private:
+    ThreadPool::ContextKey<ScratchContext> m_key;
+    std::vector<int> &m_record;
+};
+
+
+static void TestWorkerContexts()
+{
+    std::vector<int> record;
+    const size_t THREADS = 3;
+    const size_t TASKS = 300;
+    {
+    ThreadPool pool(THREADS);
+    ThreadPool::ContextKey<ScratchContext> key =
+        pool.RegisterWorkerContext<ScratchContext>([]() { return new ScratchContext; });
+
+    for (size_t i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<ScratchTask>(key, record));
+    }
+    WaitForRecord(record, TASKS);
+
+    if (contextsBuilt < 1 || static_cast<size_t>(contextsBuilt) > THREADS)
+    {
+        throw Error("Worker context was not built once per worker",
+                    "1-" + Str(THREADS), Str(contextsBuilt), __LINE__);
+    }
+
+    if (nullptr != ThreadPool::GetWorkerContext(key))
+    {
+        throw Error("Worker context reachable outside of a worker", "null", "context", __LINE__);
+    }
+    }
+
+    if (0 != contextsAlive)
+    {
+        throw Error("Worker contexts outlived their workers", Str(0), Str(contextsAlive), __LINE__);
+    }
+
+    {
+    ThreadPool pool(THREADS);
+    ThreadPool other(1);
+    ThreadPool::ContextKey<ScratchContext> key =
+        pool.RegisterWorkerContext<ScratchContext>([]() { return new ScratchContext; });
+
+    // a key does not resolve on another pool's workers
+    record.clear();
+    other.AddTask(std::make_shared<ForeignKeyTask>(key, record));
+    WaitForRecord(record, 1);
+    if (0 != record[0] || 0 != contextsAlive)
+    {
+        throw Error("Worker context key resolved on another pool", Str(0), Str(record[0]), __LINE__);
+    }
+
+    std::atomic_size_t arrived(0);
+    for (size_t i = 0; i < THREADS; ++i)
+    {
+        pool.AddTask(std::make_shared<ScratchBarrierTask>(key, arrived, THREADS));
+    }
+    for (int i = 0; i < 5000 && THREADS != static_cast<size_t>(contextsAlive); ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (THREADS != static_cast<size_t>(contextsAlive))
+    {
+        throw Error("Worker context was not built on every worker", Str(THREADS), Str(contextsAlive), __LINE__);
+    }
+
+    // shrinking destroys the retired workers' contexts, the kept one survives
+    pool.SetNumOfThreads(1);
+    for (int i = 0; i < 5000 && 1 != contextsAlive; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (1 != contextsAlive)
+    {
+        throw Error("Retired workers' contexts were not destroyed", Str(1), Str(contextsAlive), __LINE__);
+    }
+    }
+
+    std::cout << GREEN << "Pool passed worker context tests" << RESET << std::endl;
+}
+
+
+
+
+static void TestReactor()
+{
+    std::vector<int> record;
+    int pipe_fds[2];
+    if (0 != pipe(pipe_fds))
+    {
+        throw Error("pipe() failed", "0", "-1", __LINE__);
+    }
+    int event_fd = eventfd(0, EFD_NONBLOCK);
+
+    {
+    ThreadPool pool(2, ThreadPool::PRIORITY_MODE, ThreadPool::REACTOR_WAIT);
+
+    // plain tasks are woken through the reactor's eventfd
+    const int TASKS = 100;
+    for (int i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, 0));
+    }
+    WaitForRecord(record, TASKS);
+
+    pool.Watch(pipe_fds[0], EPOLLIN, [&record, &pipe_fds](uint32_t)
+    {
+        char byte = 0;
+        if (1 == read(pipe_fds[0], &byte, 1))
+        {
+            std::unique_lock<std::mutex> lock(MUTEX);
+            record.push_back(byte);
+        }
+    });
+
+    pool.Watch(event_fd, EPOLLIN, [&record, event_fd](uint32_t)
+    {
+        uint64_t value = 0;
+        if (sizeof(value) == read(event_fd, &value, sizeof(value)))
+        {
+            std::unique_lock<std::mutex> lock(MUTEX);
+            record.push_back(static_cast<int>(value));
+        }
+    }, ThreadPool::DISPATCH_TASK, ThreadPool::HIGH);
+
+    const char BYTES = 5;
+    for (char i = 1; i <= BYTES; ++i)
+    {
+        if (1 != write(pipe_fds[1], &i, 1))
+        {
+            throw Error("write() to pipe failed", "1", "-1", __LINE__);
+        }
+        WaitForRecord(record, TASKS + i);
+    }
+
+    uint64_t value = 42;
+    if (sizeof(value) != write(event_fd, &value, sizeof(value)))
+    {
+        throw Error("write() to eventfd failed", "8", "-1", __LINE__);
+    }
+    WaitForRecord(record, TASKS + BYTES + 1);
+
+    std::unique_lock<std::mutex> lock(MUTEX);
+    for (int i = 0; i < BYTES; ++i)
+    {
+        if (i + 1 != record[TASKS + i])
+        {
+            throw Error("Pipe readiness was not served in order", Str(i + 1), Str(record[TASKS + i]), __LINE__, i);
+        }
+    }
+    if (42 != record.back())
+    {
+        throw Error("Eventfd readiness was not dispatched as a task", Str(42), Str(record.back()), __LINE__);
+    }
+    lock.unlock();
+
+    pool.Unwatch(event_fd);
+
+    // Unwatch returns only once a running callback of the fd finished
+    std::atomic_int callback_state(0);
+    pool.Unwatch(pipe_fds[0]);
+    pool.Watch(pipe_fds[0], EPOLLIN, [&callback_state, &pipe_fds](uint32_t)
+    {
+        char byte = 0;
+        if (1 == read(pipe_fds[0], &byte, 1))
+        {
+            callback_state = 1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            callback_state = 2;
+        }
+    });
+    char byte = 1;
+    if (1 != write(pipe_fds[1], &byte, 1))
+    {
+        throw Error("write() to pipe failed", "1", "-1", __LINE__);
+    }
+    for (int i = 0; i < 5000 && 0 == callback_state; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pool.Unwatch(pipe_fds[0]);
+    if (2 != callback_state)
+    {
+        throw Error("Unwatch returned while its callback was running", Str(2), Str(callback_state.load()), __LINE__);
+    }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(event_fd);
+
+    std::cout << GREEN << "Pool in reactor mode passed fd readiness tests" << RESET << std::endl;
+}
+
+
+
+
+static void TestAsyncFileIO(AsyncFileIO::Backend backend_)
+{
+    char path[] = "/tmp/threadpool_aio_XXXXXX";
+    int fd = mkstemp(path);
+    if (-1 == fd)
+    {
+        throw Error("mkstemp() failed", "fd", "-1", __LINE__);
+    }
+    unlink(path);
+
+    const size_t BLOCKS = 64;
+    const size_t BLOCK_SIZE = 512;
+    std::vector<char> out(BLOCKS * BLOCK_SIZE);
+    std::vector<char> in(BLOCKS * BLOCK_SIZE, 0);
+    for (size_t i = 0; i < out.size(); ++i)
+    {
+        out[i] = static_cast<char>('a' + (i / BLOCK_SIZE) % 26);
+    }
+
+    bool usedIoUring = false;
+    std::atomic_size_t onCaller(0);
+    std::atomic_size_t callbacks(0);
+    std::thread::id caller = std::this_thread::get_id();
+    {
+    ThreadPool pool(2);
+    AsyncFileIO io(pool, 16, 2, backend_);
+    usedIoUring = io.UsesIoUring();
+
+    IOFuture::Callback count = [&](ssize_t)
+    {
+        onCaller += (std::this_thread::get_id() == caller);
+        ++callbacks;
+    };
+
+    // concurrent submitters share enters and overrun the 16-entry queue
+    const size_t SUBMITTERS = 4;
+    std::vector<AsyncFileIO::IOFuturePtr> writes(BLOCKS);
+    std::vector<std::thread> submitters;
+    for (size_t t = 0; t < SUBMITTERS; ++t)
+    {
+        submitters.emplace_back([&, t]()
+        {
+            for (size_t i = t; i < BLOCKS; i += SUBMITTERS)
+            {
+                writes[i] = io.WriteAsync(fd, &out[i * BLOCK_SIZE], BLOCK_SIZE, i * BLOCK_SIZE, count);
+            }
+        });
+    }
+    for (std::thread &submitter : submitters)
+    {
+        submitter.join();
+    }
+    for (size_t i = 0; i < BLOCKS; ++i)
+    {
+        if (static_cast<ssize_t>(BLOCK_SIZE) != writes[i]->GetResult())
+        {
+            throw Error("WriteAsync wrote a short block", Str(BLOCK_SIZE), Str(writes[i]->GetResult()), __LINE__, i);
+        }
+    }
+
+    if (0 != io.FsyncAsync(fd, count)->GetResult())
+    {
+        throw Error("FsyncAsync failed", "0", "errno", __LINE__);
+    }
+
+    std::vector<AsyncFileIO::IOFuturePtr> reads;
+    for (size_t i = 0; i < BLOCKS; ++i)
+    {
+        reads.push_back(io.ReadAsync(fd, &in[i * BLOCK_SIZE], BLOCK_SIZE, i * BLOCK_SIZE, count, ThreadPool::HIGH));
+    }
+    for (size_t i = 0; i < BLOCKS; ++i)
+    {
+        reads[i]->GetResult();
+    }
+    }
+    close(fd);
+
+    if (0 != memcmp(out.data(), in.data(), out.size()))
+    {
+        throw Error("ReadAsync did not read back what WriteAsync wrote", "equal", "different", __LINE__);
+    }
+    if (2 * BLOCKS + 1 != callbacks || 0 != onCaller)
+    {
+        throw Error("I/O completions were not delivered on pool workers",
+                    Str(2 * BLOCKS + 1), Str(callbacks), __LINE__);
+    }
+
+    std::cout << GREEN << "Async file I/O passed read/write/fsync tests ("
+              << (usedIoUring ? "io_uring" : "blocking threads") << ")" << RESET << std::endl;
+}
+
+
+
+
+static void TestPipeline(size_t threads_)
+{
+    const int ITEMS = 5000;
+    std::vector<int> record;
+    {
+    ThreadPool pool(threads_);
+
+    // unique_ptr items prove stages move rather than copy
+    std::unique_ptr<Pipeline<int>> pipeline = PipelineBuilder<int>(pool, 8)
+        .Then<std::unique_ptr<int>>([](int i) { return std::unique_ptr<int>(new int(i)); }, 4)
+        .Then<std::unique_ptr<int>>([](std::unique_ptr<int> p) { *p *= 2; return p; }, 4, ORDERED)
+        .Sink([&record](std::unique_ptr<int> p) { record.push_back(*p); }, 1, SERIAL);
+
+    for (int i = 0; i < ITEMS; ++i)
+    {
+        pipeline->Push(i);
+    }
+    pipeline->Close();
+    pipeline->Wait();
+    }
+
+    if (static_cast<size_t>(ITEMS) != record.size())
+    {
+        throw Error("Pipeline lost items", Str(ITEMS), Str(record.size()), __LINE__);
+    }
+
+    // stage one is unordered, so compare as a set
+    std::vector<int> sorted(record);
+    std::sort(sorted.begin(), sorted.end());
+    for (int i = 0; i < ITEMS; ++i)
+    {
+        if (2 * i != sorted[i])
+        {
+            throw Error("Pipeline corrupted items", Str(2 * i), Str(sorted[i]), __LINE__, i);
+        }
+    }
+
+    // fully ordered chain keeps source order
+    record.clear();
+    {
+    ThreadPool pool(threads_);
+    std::unique_ptr<Pipeline<int>> pipeline = PipelineBuilder<int>(pool, 4)
+        .Then<int>([](int i) { return i + 1; }, 3, ORDERED)
+        .Sink([&record](int i) { record.push_back(i); }, 3, ORDERED);
+
+    for (int i = 0; i < ITEMS; ++i)
+    {
+        pipeline->Push(i);
+    }
+    }
+
+    for (int i = 0; i < ITEMS; ++i)
+    {
+        if (i + 1 != record[i])
+        {
+            throw Error("ORDERED stages did not keep input order", Str(i + 1), Str(record[i]), __LINE__, i);
+        }
+    }
+
+    std::cout << GREEN << "Pipeline on " << threads_ << " threads passed streaming tests" << RESET << std::endl;
+}
+
+
+
+
+static void TestRecording()
+{
+    char path[] = "/tmp/threadpool_rec_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    const size_t PER_PRODUCER = 200;
+    const size_t QUEUED = 3;
+    std::vector<int> record;
+    {
+    ThreadPool pool(2);
+    if (false == pool.StartRecording(path))
+    {
+        throw Error("StartRecording failed", "true", "false", __LINE__);
+    }
+
+    std::thread producers[2];
+    for (int p = 0; p < 2; ++p)
+    {
+        producers[p] = std::thread([&pool, &record, p]()
+        {
+            for (size_t i = 0; i < PER_PRODUCER; ++i)
+            {
+                pool.AddTask(std::make_shared<RecordTask>(record, p), p ? ThreadPool::HIGH : ThreadPool::LOW);
+            }
+        });
+    }
+    producers[0].join();
+    producers[1].join();
+    WaitForRecord(record, 2 * PER_PRODUCER);
+
+    // still queued at StopRecording: logged as added, never as run
+    pool.Pause();
+    for (size_t i = 0; i < QUEUED; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, 3));
+    }
+    pool.StopRecording();
+    pool.AddTask(std::make_shared<RecordTask>(record, 2)); // not recorded
+    pool.Resume();
+    WaitForRecord(record, 2 * PER_PRODUCER + QUEUED + 1);
+    }
+
+    std::vector<TaskRecord> records;
+    bool loaded = TaskRecorder::Load(path, records);
+    unlink(path);
+    if (false == loaded || 2 * PER_PRODUCER + QUEUED != records.size())
+    {
+        throw Error("Recording lost tasks", Str(2 * PER_PRODUCER + QUEUED), Str(records.size()), __LINE__);
+    }
+
+    std::set<uint32_t> producerIds;
+    size_t high = 0;
+    size_t never_ran = 0;
+    for (const TaskRecord &r : records)
+    {
+        producerIds.insert(r.producer);
+        high += (ThreadPool::HIGH == r.priority);
+        never_ran += (0 == r.completed);
+    }
+    // the main thread added the queued ones
+    if (3 != producerIds.size() || PER_PRODUCER != high)
+    {
+        throw Error("Recording mixed up producers or priorities", Str(PER_PRODUCER), Str(high), __LINE__);
+    }
+    if (QUEUED != never_ran)
+    {
+        throw Error("Recording logged unrun tasks as completed", Str(QUEUED), Str(never_ran), __LINE__);
+    }
+
+    std::cout << GREEN << "Pool passed record tests" << RESET << std::endl;
+}
+
+
+
+
+static void TestSharedMemoryQueue()
+{
+    const std::string name = "/threadpool_test_" + Str(getpid());
+    const int PRODUCERS = 3;
+    const int JOBS = 2000;
+
+    // small ring, so producers also block on a full queue
+    std::unique_ptr<ShmTaskQueue> queue = ShmTaskQueue::Create(name, 64);
+    if (!queue)
+    {
+        throw Error("ShmTaskQueue::Create failed", "queue", "null", __LINE__);
+    }
+
+    // producers are forked while this process has no pool threads, and
+    // start once the handler is in: closing start[1] releases them all
+    int start[2];
+    if (0 != pipe(start))
+    {
+        throw Error("pipe() failed", "0", "-1", __LINE__);
+    }
+    pid_t children[PRODUCERS];
+    for (int p = 0; p < PRODUCERS; ++p)
+    {
+        children[p] = fork();
+        if (0 == children[p])
+        {
+            close(start[1]);
+            char byte = 0;
+            while (-1 == read(start[0], &byte, 1) && EINTR == errno)
+            {
+                // retry until EOF
+            }
+            std::unique_ptr<ShmTaskQueue> producer = ShmTaskQueue::Open(name);
+            for (int i = 0; producer && i < JOBS; ++i)
+            {
+                int value = p * JOBS + i;
+                producer->Push(1, &value, sizeof(value));
+            }
+            int stray = 0;
+            if (producer)
+            {
+                producer->Push(2, &stray, sizeof(stray)); // nobody handles id 2
+            }
+            _exit(producer ? 0 : 1);
+        }
+    }
+    close(start[0]);
+
+    std::atomic_size_t handled(0);
+    std::atomic<long> sum(0);
+    size_t unhandled = 0;
+    {
+    ThreadPool pool(2);
+    ShmTaskServer server(pool, *queue);
+    server.RegisterHandler(1, [&](const char *payload_, size_t length_)
+    {
+        int value = 0;
+        memcpy(&value, payload_, length_);
+        sum += value;
+        ++handled;
+    });
+    close(start[1]);
+
+    while (handled < static_cast<size_t>(PRODUCERS * JOBS) || server.GetUnhandled() < static_cast<size_t>(PRODUCERS))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    unhandled = server.GetUnhandled();
+    }
+
+    for (int p = 0; p < PRODUCERS; ++p)
+    {
+        int status = 0;
+        waitpid(children[p], &status, 0);
+        if (!WIFEXITED(status) || 0 != WEXITSTATUS(status))
+        {
+            throw Error("Producer process failed", "0", Str(status), __LINE__, p);
+        }
+    }
+
+    long n = PRODUCERS * JOBS;
+    if (n * (n - 1) / 2 != sum || static_cast<size_t>(PRODUCERS) != unhandled)
+    {
+        throw Error("Cross-process jobs were lost or duplicated", Str(n * (n - 1) / 2), Str(sum), __LINE__);
+    }
+
+    // a segment claiming a ring larger than its size is refused
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    void *mapping = (-1 == fd) ? MAP_FAILED : mmap(nullptr, 64, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (-1 != fd)
+    {
+        close(fd);
+    }
+    if (MAP_FAILED == mapping)
+    {
+        throw Error("Cannot map the queue segment", "mapping", "MAP_FAILED", __LINE__);
+    }
+    uint64_t *mask = static_cast<uint64_t *>(mapping) + 1; // follows the magic
+    uint64_t saved = *mask;
+    *mask = (uint64_t(1) << 40) - 1;
+    bool opened = (nullptr != ShmTaskQueue::Open(name));
+    *mask = saved;
+    munmap(mapping, 64);
+    if (opened)
+    {
+        throw Error("Open trusted an oversized ring mask", "null", "queue", __LINE__);
+    }
+
+    std::cout << GREEN << "Pool passed shared-memory queue tests" << RESET << std::endl;
+}
+
+
+
+
+class BlockingTask : public ThreadPool::ITask
+{
+public:
+    BlockingTask(std::mutex &mutex_, std::condition_variable &cv_, bool &release_, std::atomic_int &blocked_) :
+        m_mutex(mutex_), m_cv(cv_), m_release(release_), m_blocked(blocked_) { }
+
+    virtual void Execute()
+    {
+        ThreadPool::BlockingScope blocking;
+        ThreadPool::BlockingScope nested; // must not compensate twice
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_blocked;
+        m_cv.wait(lock, [this]() { return m_release; });
+    }
+private:
+    std::mutex &m_mutex;
+    std::condition_variable &m_cv;
+    bool &m_release;
+    std::atomic_int &m_blocked;
+};
+
+
+static bool WaitForThreads(const ThreadPool &pool_, size_t threads_)
+{
+    for (int i = 0; i < 5000 && threads_ != pool_.GetNumOfThreads(); ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return threads_ == pool_.GetNumOfThreads();
+}
+
+
+static void TestBlockingScope()
+{
+    std::vector<int> record;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool release = false;
+    std::atomic_int blocked(0);
+    {
+    const size_t THREADS = 2;
+    ThreadPool pool(THREADS);
+
+    // both workers block, tasks behind them must still run
+    for (size_t i = 0; i < THREADS; ++i)
+    {
+        pool.AddTask(std::make_shared<BlockingTask>(mutex, cv, release, blocked), ThreadPool::HIGH);
+    }
+    while (static_cast<int>(THREADS) != blocked)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    const size_t TASKS = 50;
+    for (size_t i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, 0));
+    }
+    WaitForRecord(record, TASKS);
+
+    if (2 * THREADS != pool.GetNumOfThreads())
+    {
+        throw Error("Blocked workers were not compensated once each",
+                    Str(2 * THREADS), Str(pool.GetNumOfThreads()), __LINE__);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        release = true;
+    }
+    cv.notify_all();
+
+    if (false == WaitForThreads(pool, THREADS))
+    {
+        throw Error("Compensating workers were not retired",
+                    Str(THREADS), Str(pool.GetNumOfThreads()), __LINE__);
+    }
+    }
+
+    std::cout << GREEN << "Pool passed blocking scope tests" << RESET << std::endl;
+}
+
+
+
+
+static int Square(int x_)
+{
+    return x_ * x_;
+}
+
+
+static int SleepFor(int ms_)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms_));
+    return ms_;
+}
+
+
+static void TestWhenAllAny()
+{
+    {
+    ThreadPool pool(2);
+    pool.Pause(); // continuations must be wired before anything completes
+
+    const int FUTURES = 20;
+    std::vector<std::shared_ptr<FutureTask<int, int>>> futures;
+    for (int i = 0; i < FUTURES; ++i)
+    {
+        futures.push_back(std::make_shared<FutureTask<int, int>>(Square, i));
+    }
+
+    std::atomic_int sum(-1);
+    std::atomic_bool on_worker(false);
+    const std::thread::id caller = std::this_thread::get_id();
+    std::shared_ptr<CombinedFuture> all = WhenAll(pool, futures, ThreadPool::HIGH);
+    all->OnReady([&]()
+    {
+        int total = 0;
+        for (const auto &future : futures)
+        {
+            total += future->GetResult(); // all ready, never blocks
+        }
+        on_worker = (std::this_thread::get_id() != caller);
+        all->Wait(); // does not wait for itself
+        sum = total;
+    });
+
+    for (const auto &future : futures)
+    {
+        pool.AddTask(future);
+    }
+    if (all->IsReady())
+    {
+        throw Error("WhenAll completed before its children ran", "false", "true", __LINE__);
+    }
+    pool.Resume();
+    all->Wait(); // also covers the continuation
+
+    int expected = 0;
+    for (int i = 0; i < FUTURES; ++i)
+    {
+        expected += i * i;
+    }
+    if (expected != sum)
+    {
+        throw Error("WhenAll continuation saw wrong results", Str(expected), Str(sum), __LINE__);
+    }
+    if (false == on_worker)
+    {
+        throw Error("WhenAll continuation did not run on a worker", "true", "false", __LINE__);
+    }
+
+    // mixed children, a nested combinator and the variadic form
+    auto slow = std::make_shared<FutureTask<int, int>>(SleepFor, 200);
+    auto fast = std::make_shared<FutureTask<int, int>>(SleepFor, 1);
+    std::shared_ptr<CombinedFuture> any = WhenAny(pool, ThreadPool::HIGH, slow, fast);
+    std::shared_ptr<CombinedFuture> both = WhenAll(pool, any, slow);
+    pool.AddTask(slow);
+    pool.AddTask(fast);
+
+    if (1 != any->GetIndex())
+    {
+        throw Error("WhenAny did not report the first child", "1", Str(any->GetIndex()), __LINE__);
+    }
+    if (slow->IsReady())
+    {
+        throw Error("WhenAny waited for every child", "false", "true", __LINE__);
+    }
+    both->Wait();
+    if (false == slow->IsReady())
+    {
+        throw Error("Nested WhenAll completed early", "true", "false", __LINE__);
+    }
+
+    std::shared_ptr<CombinedFuture> empty = WhenAll(pool, std::vector<std::shared_ptr<CombinedFuture>>());
+    empty->Wait();
+    }
+
+    std::cout << GREEN << "Pool passed WhenAll/WhenAny tests" << RESET << std::endl;
+}
+
+
+
+
+// long LOW task, polls YieldIfNeeded until something ran inline or time is up
+class YieldingTask : public ThreadPool::ITask
+{
+public:
+    YieldingTask(std::atomic_bool &started_, std::atomic_int &yields_) : m_started(started_), m_yields(yields_) { }
+
+    virtual void Execute()
+    {
+        m_started = true;
+        ThreadPool::Clock::time_point end = ThreadPool::Clock::now() + std::chrono::seconds(5);
+        while (0 == m_yields && ThreadPool::Clock::now() < end)
+        {
+            if (ThreadPool::YieldIfNeeded())
+            {
+                ++m_yields;
+            }
+        }
+    }
+private:
+    std::atomic_bool &m_started;
+    std::atomic_int &m_yields;
+};
+
+
+static void TestYieldIfNeeded()
+{
+    if (ThreadPool::YieldIfNeeded())
+    {
+        throw Error("YieldIfNeeded yielded outside a worker", "false", "true", __LINE__);
+    }
+
+    std::vector<int> record;
+    std::atomic_bool started(false);
+    std::atomic_int yields(0);
+    {
+    ThreadPool pool(1);
+    pool.AddTask(std::make_shared<YieldingTask>(started, yields), ThreadPool::LOW);
+    while (false == started)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // the only worker is busy, a LOW task must wait and HIGH ones cut in
+    pool.AddTask(std::make_shared<RecordTask>(record, 0), ThreadPool::LOW);
+    pool.AddTask(std::make_shared<RecordTask>(record, 2), ThreadPool::HIGH);
+    pool.AddTask(std::make_shared<RecordTask>(record, 1), ThreadPool::NORMAL);
+    WaitForRecord(record, 3);
+    }
+
+    if (1 != yields)
+    {
+        throw Error("Long task did not yield", "1", Str(yields), __LINE__);
+    }
+    std::vector<int> expected = {2, 1, 0};
+    if (expected != record)
+    {
+        throw Error("Yield ran the wrong tasks inline", "2 1 0",
+                    Str(record[0]) + " " + Str(record[1]) + " " + Str(record[2]), __LINE__);
+    }
+
+    std::cout << GREEN << "Pool passed cooperative yield tests" << RESET << std::endl;
+}
+
+
+
+
+class SpinTask : public ThreadPool::ITask
+{
+public:
+    SpinTask(std::chrono::milliseconds time_) : m_time(time_) { }
+
+    virtual void Execute()
+    {
+        ThreadPool::Clock::time_point start = ThreadPool::Clock::now();
+        while (ThreadPool::Clock::now() - start < m_time)
+        {
+            // burn CPU
+        }
+    }
+
+    virtual const char *GetTypeTag() const
+    {
+        return "spin";
+    }
+private:
+    std::chrono::milliseconds m_time;
+};
+
+
+static void TestTaskStats()
+{
+    using std::chrono::milliseconds;
+
+    std::vector<int> record;
+    const size_t RECORDS = 100;
+    const size_t SPINS = 5;
+    std::unordered_map<std::string, TaskStats> stats;
+    {
+    ThreadPool pool(2);
+    pool.AddTask(std::make_shared<RecordTask>(record, 0)); // before enabling, not counted
+    WaitForRecord(record, 1);
+
+    pool.SetTaskStats(ThreadPool::STATS_CPU);
+    pool.Pause();
+    for (size_t i = 0; i < RECORDS; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, 0));
+    }
+    for (size_t i = 0; i < SPINS; ++i)
+    {
+        pool.AddTask(std::make_shared<SpinTask>(milliseconds(10)), ThreadPool::LOW);
+    }
+    std::this_thread::sleep_for(milliseconds(20));
+    pool.Resume();
+    WaitForRecord(record, RECORDS + 1);
+
+    pool.SetNumOfThreads(1); // retired worker's table must survive
+    while (pool.GetTaskStats()["spin"].count < SPINS)
+    {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    stats = pool.GetTaskStats();
+    }
+
+    const TaskStats &records = stats["RecordTask"];
+    const TaskStats &spins = stats["spin"];
+    if (RECORDS != records.count || SPINS != spins.count)
+    {
+        throw Error("Task types were not counted", Str(RECORDS) + "/" + Str(SPINS),
+                    Str(records.count) + "/" + Str(spins.count), __LINE__);
+    }
+    // spinners may share a CPU, so their CPU time is only bounded by wall time
+    if (spins.wall < milliseconds(10 * SPINS) || spins.cpu <= milliseconds(0) || spins.cpu > spins.wall)
+    {
+        throw Error("Task type times were not accumulated", ">= " + Str(10 * SPINS) + "ms wall",
+                    Str(std::chrono::duration_cast<milliseconds>(spins.wall).count()) + "ms wall, " +
+                    Str(std::chrono::duration_cast<milliseconds>(spins.cpu).count()) + "ms cpu", __LINE__);
+    }
+    if (records.queue_wait < milliseconds(20 * RECORDS))
+    {
+        throw Error("Queue wait was not accumulated", ">= " + Str(20 * RECORDS) + "ms",
+                    Str(std::chrono::duration_cast<milliseconds>(records.queue_wait).count()) + "ms", __LINE__);
+    }
+
+    // a task run inline by YieldIfNeeded is not charged to the yielding one
+    std::atomic_bool started(false);
+    std::atomic_int yields(0);
+    {
+    ThreadPool pool(1);
+    pool.SetTaskStats(ThreadPool::STATS_WALL);
+    pool.AddTask(std::make_shared<YieldingTask>(started, yields), ThreadPool::LOW);
+    while (false == started)
+    {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    pool.AddTask(std::make_shared<SpinTask>(milliseconds(100)), ThreadPool::HIGH);
+    while (pool.GetTaskStats()["YieldingTask"].count < 1)
+    {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    stats = pool.GetTaskStats();
+    }
+
+    if (1 != yields || stats["spin"].wall < milliseconds(100) || stats["YieldingTask"].wall >= milliseconds(100))
+    {
+        throw Error("Inline task time was charged to the yielding task", "< 100ms",
+                    Str(std::chrono::duration_cast<milliseconds>(stats["YieldingTask"].wall).count()) + "ms",
+                    __LINE__);
+    }
+
+    std::cout << GREEN << "Pool passed task accounting tests" << RESET << std::endl;
+}
+
+
+
+
+class StackSizeTask : public ThreadPool::ITask
+{
+public:
+    StackSizeTask(std::atomic_size_t &size_) : m_size(size_) { }
+
+    virtual void Execute()
+    {
+        pthread_attr_t attr;
+        size_t size = 0;
+        if (0 == pthread_getattr_np(pthread_self(), &attr))
+        {
+            pthread_attr_getstacksize(&attr, &size);
+            pthread_attr_destroy(&attr);
+        }
+        m_size = size;
+    }
+private:
+    std::atomic_size_t &m_size;
+};
+
+
+static void TestLifecycle()
+{
+    using std::chrono::milliseconds;
+
+    const size_t STACK = 256 * 1024;
+    std::atomic_size_t stack(0);
+    {
+    ThreadPool pool(16, ThreadPool::PRIORITY_MODE, ThreadPool::QUEUE_WAIT, STACK);
+    if (false == WaitForThreads(pool, 16))
+    {
+        throw Error("Workers were not all spawned", "16", Str(pool.GetNumOfThreads()), __LINE__);
+    }
+
+    pool.AddTask(std::make_shared<StackSizeTask>(stack));
+    pool.SetNumOfThreads(2);
+    if (false == WaitForThreads(pool, 2))
+    {
+        throw Error("Shrunk workers did not retire", "2", Str(pool.GetNumOfThreads()), __LINE__);
+    }
+    pool.SetNumOfThreads(4);
+    if (false == WaitForThreads(pool, 4))
+    {
+        throw Error("Pool did not grow back", "4", Str(pool.GetNumOfThreads()), __LINE__);
+    }
+    }
+    // sanitizers may add their own room on top
+    if (stack < STACK || stack >= 4 * STACK)
+    {
+        throw Error("Workers did not get the requested stack size", Str(STACK), Str(stack), __LINE__);
+    }
+
+    // drain runs everything queued before stopping
+    std::vector<int> record;
+    const size_t TASKS = 100;
+    {
+    ThreadPool pool(2);
+    pool.Pause();
+    for (size_t i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, 0), ThreadPool::LOW);
+    }
+    if (false == pool.Shutdown(ThreadPool::SHUTDOWN_DRAIN, milliseconds(5000)) || TASKS != record.size())
+    {
+        throw Error("Drain shutdown did not run queued tasks", Str(TASKS), Str(record.size()), __LINE__);
+    }
+    }
+
+    // cancel drops them, even from a paused pool
+    record.clear();
+    {
+    ThreadPool pool(1);
+    pool.Pause();
+    for (size_t i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<RecordTask>(record, 0), ThreadPool::HIGH);
+    }
+    if (false == pool.Shutdown(ThreadPool::SHUTDOWN_CANCEL, milliseconds(5000)) || 0 != record.size())
+    {
+        throw Error("Cancel shutdown ran queued tasks", "0", Str(record.size()), __LINE__);
+    }
+    }
+
+    // a task outliving the timeout is reported, the destructor still waits for it
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool release = false;
+    std::atomic_int blocked(0);
+    {
+    ThreadPool pool(1);
+    pool.AddTask(std::make_shared<BlockingTask>(mutex, cv, release, blocked));
+    while (0 == blocked)
+    {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    if (pool.Shutdown(ThreadPool::SHUTDOWN_CANCEL, milliseconds(20)))
+    {
+        throw Error("Shutdown ignored a running task", "false", "true", __LINE__);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        release = true;
+    }
+    cv.notify_all();
+    }
+
+    std::cout << GREEN << "Pool passed lifecycle tests" << RESET << std::endl;
+}
+
+
+
+
+class CountTask : public ThreadPool::ITask
+{
+public:
+    CountTask(std::atomic_size_t &count_) : m_count(count_) { }
+
+    virtual void Execute()
+    {
+        ++m_count;
+    }
+private:
+    std::atomic_size_t &m_count;
+};
+
+
+static void TestIngress(ThreadPool::WaitMode wait_)
+{
+    // more tasks per producer than a shard lane holds, so some take the queue
+    const size_t PRODUCERS = 64;
+    const size_t TASKS = ThreadPool::SHARD_LANE_CAPACITY * 2;
+    std::atomic_size_t count(0);
+    {
+    ThreadPool pool(4, ThreadPool::PRIORITY_MODE, wait_);
+    std::vector<std::thread> producers;
+    for (size_t i = 0; i < PRODUCERS; ++i)
+    {
+        producers.push_back(std::thread([&pool, &count, i, TASKS]()
+        {
+            for (size_t task = 0; task < TASKS; ++task)
+            {
+                pool.AddTask(std::make_shared<CountTask>(count), static_cast<ThreadPool::Priority>((i + task) % 3));
+            }
+        }));
+    }
+    for (std::thread &producer : producers)
+    {
+        producer.join();
+    }
+
+    // tasks still sitting in the shards count as queued
+    if (false == pool.Shutdown(ThreadPool::SHUTDOWN_DRAIN, std::chrono::seconds(10)) || PRODUCERS * TASKS != count)
+    {
+        throw Error("Tasks from many producers were lost", Str(PRODUCERS * TASKS), Str(count), __LINE__);
+    }
+    }
+
+    // priority holds across shards
+    const size_t PER_PRIORITY = 10;
+    std::vector<int> record;
+    {
+    ThreadPool pool(1, ThreadPool::PRIORITY_MODE, wait_);
+    pool.Pause();
+    std::vector<std::thread> producers;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        producers.push_back(std::thread([&pool, &record, PER_PRIORITY]()
+        {
+            for (size_t task = 0; task < PER_PRIORITY; ++task)
+            {
+                pool.AddTask(std::make_shared<RecordTask>(record, 0), ThreadPool::LOW);
+                pool.AddTask(std::make_shared<RecordTask>(record, 2), ThreadPool::HIGH);
+            }
+        }));
+    }
+    for (std::thread &producer : producers)
+    {
+        producer.join();
+    }
+    pool.Resume();
+    WaitForRecord(record, 8 * PER_PRIORITY * 2);
+    }
+
+    for (size_t i = 0; i < record.size(); ++i)
+    {
+        int expected = (i < 8 * PER_PRIORITY) ? 2 : 0;
+        if (expected != record[i])
+        {
+            throw Error("Sharded tasks ran out of priority order", Str(expected), Str(record[i]), __LINE__);
+        }
+    }
+
+    std::cout << GREEN << "Pool in " << (ThreadPool::REACTOR_WAIT == wait_ ? "reactor" : "queue")
+              << " mode passed sharded ingress tests" << RESET << std::endl;
+}
+
+
+
+
+static void TestAutoSizing()
+{
+    const double EPSILON = 1e-9;
+    if (0 != ParseCpuMax("max 100000") || std::abs(1.5 - ParseCpuMax("150000 100000")) > EPSILON ||
+        std::abs(2 - ParseCpuMax("200000")) > EPSILON)
+    {
+        throw Error("cpu.max parsed wrong", "0 1.5 2", Str(ParseCpuMax("max 100000")) + " " +
+                    Str(ParseCpuMax("150000 100000")) + " " + Str(ParseCpuMax("200000")), __LINE__);
+    }
+    if (0 != CfsQuotaCpus(-1, 100000) || std::abs(4 - CfsQuotaCpus(400000, 100000)) > EPSILON)
+    {
+        throw Error("cfs quota converted wrong", "0 4",
+                    Str(CfsQuotaCpus(-1, 100000)) + " " + Str(CfsQuotaCpus(400000, 100000)), __LINE__);
+    }
+
+    // never more CPU-bound workers than CPUs the process may run on
+    size_t cpu_bound = ThreadPool::Auto(ThreadPool::CPU_BOUND);
+    size_t io_bound = ThreadPool::Auto(ThreadPool::IO_BOUND);
+    if (0 == cpu_bound || cpu_bound > AffinityCpus() || io_bound < cpu_bound)
+    {
+        throw Error("Auto sized out of the affinity mask", "1.." + Str(AffinityCpus()),
+                    Str(cpu_bound) + " / " + Str(io_bound), __LINE__);
+    }
+
+    // limits do not change here, so auto sizing keeps a size set by hand
+    std::vector<int> record;
+    {
+    ThreadPool pool(cpu_bound);
+    pool.StartAutoSizing(ThreadPool::IO_BOUND, std::chrono::milliseconds(1));
+    pool.SetNumOfThreads(cpu_bound + 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    pool.StopAutoSizing();
+    if (false == WaitForThreads(pool, cpu_bound + 1))
+    {
+        throw Error("Auto sizing resized without a limit change", Str(cpu_bound + 1),
+                    Str(pool.GetNumOfThreads()), __LINE__);
+    }
+
+    // restarted, then left for the destructor to stop
+    pool.StartAutoSizing(ThreadPool::CPU_BOUND, std::chrono::milliseconds(1));
+    pool.AddTask(std::make_shared<RecordTask>(record, 1));
+    WaitForRecord(record, 1);
+    }
+
+    // racing Start/Stop callers leave at most one sizer, a Start after
+    // Shutdown starts none that could outlive the pool
+    {
+    ThreadPool pool(cpu_bound);
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 4; ++i)
+    {
+        callers.emplace_back([&pool, i]()
+        {
+            for (int j = 0; j < 20; ++j)
+            {
+                if (0 == (i + j) % 2)
+                {
+                    pool.StartAutoSizing(ThreadPool::CPU_BOUND, std::chrono::milliseconds(1));
+                }
+                else
+                {
+                    pool.StopAutoSizing();
+                }
+            }
+        });
+    }
+    for (std::thread &caller : callers)
+    {
+        caller.join();
+    }
+    pool.Shutdown(ThreadPool::SHUTDOWN_DRAIN, std::chrono::milliseconds(1000));
+    pool.StartAutoSizing(ThreadPool::CPU_BOUND, std::chrono::milliseconds(1));
+    }
+
+    std::cout << GREEN << "Pool passed auto sizing tests (" << cpu_bound << " CPU-bound / " << io_bound
+              << " IO-bound workers)" << RESET << std::endl;
+}
+
+
+
+
+static std::atomic_size_t g_basic_count(0);
+
+static void CountBasic()
+{
+    ++g_basic_count;
+}
+
+template <typename Pool>
+static void RunBasicCount(size_t threads_)
+{
+    const size_t TASKS = 10000;
+    g_basic_count = 0;
+    {
+    Pool pool(threads_);
+    for (size_t i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(&CountBasic);
+    }
+    }
+
+    // the destructor runs what was queued
+    if (TASKS != g_basic_count)
+    {
+        throw Error("BasicThreadPool lost tasks", Str(TASKS), Str(g_basic_count), __LINE__);
+    }
+}
+
+static void TestBasicThreadPool()
+{
+    using namespace pool_policy;
+
+    RunBasicCount<BasicThreadPool<FifoQueue, BlockingWait, InlineTask<void (*)()>>>(4);
+    RunBasicCount<BasicThreadPool<FifoQueue, SpinThenBlockWait<>, InlineTask<void (*)()>>>(4);
+    RunBasicCount<FifoThreadPool>(1);
+
+    // one worker held by the first task, so the rest queue up behind it
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool release = false;
+    std::atomic_int blocked(0);
+    std::vector<int> record;
+    {
+    FifoThreadPool pool(1);
+    pool.AddTask([&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++blocked;
+        cv.wait(lock, [&release]() { return release; });
+    });
+    for (int i = 0; i < 5; ++i)
+    {
+        pool.AddTask([&record, i]() { std::unique_lock<std::mutex> lock(MUTEX); record.push_back(i); }, ThreadPool::HIGH);
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        release = true;
+    }
+    cv.notify_all();
+    }
+
+    std::vector<int> expected = {0, 1, 2, 3, 4};
+    if (expected != record)
+    {
+        throw Error("FifoQueue reordered tasks", "0 1 2 3 4", Str(record.size()) + " tasks", __LINE__);
+    }
+
+    record.clear();
+    release = false;
+    blocked = 0;
+    {
+    PriorityThreadPool pool(1);
+    pool.AddTask(std::make_shared<BlockingTask>(mutex, cv, release, blocked));
+    while (0 == blocked)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pool.AddTask(std::make_shared<RecordTask>(record, 0), ThreadPool::LOW);
+    pool.AddTask(std::make_shared<RecordTask>(record, 1), ThreadPool::NORMAL);
+    pool.AddTask(std::make_shared<RecordTask>(record, 2), ThreadPool::HIGH);
+    pool.AddTask(std::make_shared<RecordTask>(record, 3), ThreadPool::HIGH);
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        release = true;
+    }
+    cv.notify_all();
+    }
+
+    expected = {2, 3, 1, 0};
+    if (expected != record)
+    {
+        throw Error("PriorityQueue ran tasks out of order", "2 3 1 0",
+                    Str(record[0]) + " " + Str(record[1]) + " " + Str(record[2]) + " " + Str(record[3]), __LINE__);
+    }
+
+    std::cout << GREEN << "BasicThreadPool passed policy tests" << RESET << std::endl;
+}
+
+
+
+
+// blocks until count_ of them run at once, so every worker is inside its loop
+class BarrierTask : public ThreadPool::ITask
+{
+public:
+    BarrierTask(std::atomic_size_t &arrived_, size_t count_) : m_arrived(arrived_), m_count(count_) { }
+
+    virtual void Execute()
+    {
+        ++m_arrived;
+        while (m_arrived < m_count)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+private:
+    std::atomic_size_t &m_arrived;
+    size_t m_count;
+};
+
+class ThreadIdTask : public ThreadPool::ITask
+{
+public:
+    ThreadIdTask(std::vector<std::thread::id> &ids_, std::atomic_size_t &done_) : m_ids(ids_), m_done(done_) { }
+
+    virtual void Execute()
+    {
+        {
+            std::unique_lock<std::mutex> lock(MUTEX);
+            m_ids.push_back(std::this_thread::get_id());
+        }
+        ++m_done;
+    }
+private:
+    std::vector<std::thread::id> &m_ids;
+    std::atomic_size_t &m_done;
+};
+
+static void TestAffinity()
+{
+    const size_t THREADS = 4;
+    const size_t TASKS = 50;
+    std::vector<std::vector<std::thread::id>> ids(THREADS);
+    std::atomic_size_t done(0);
+    {
+    ThreadPool pool(THREADS);
+    pool.SetAffinityStealThreshold(TASKS * THREADS); // never overloaded
+    std::atomic_size_t arrived(0);
+    for (size_t i = 0; i < THREADS; ++i)
+    {
+        pool.AddTask(std::make_shared<BarrierTask>(arrived, THREADS));
+    }
+    while (arrived < THREADS)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (size_t task = 0; task < TASKS; ++task)
+    {
+        for (size_t key = 0; key < THREADS; ++key)
+        {
+            pool.AddTask(std::make_shared<ThreadIdTask>(ids[key], done), ThreadPool::NORMAL, key);
+        }
+    }
+    while (done < TASKS * THREADS)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    }
+
+    std::set<std::thread::id> owners;
+    for (size_t key = 0; key < THREADS; ++key)
+    {
+        std::set<std::thread::id> workers(ids[key].begin(), ids[key].end());
+        if (1 != workers.size())
+        {
+            throw Error("Tasks of one affinity key ran on several workers", "1", Str(workers.size()), __LINE__);
+        }
+        owners.insert(*workers.begin());
+    }
+    if (THREADS != owners.size())
+    {
+        throw Error("Affinity keys did not spread over the workers", Str(THREADS), Str(owners.size()), __LINE__);
+    }
+
+    // an owner stuck in a long task has its slot stolen from past the threshold
+    const size_t THRESHOLD = 4;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool release = false;
+    std::atomic_int blocked(0);
+    std::vector<std::thread::id> stolen;
+    done = 0;
+    {
+    ThreadPool pool(2);
+    pool.SetAffinityStealThreshold(THRESHOLD);
+    std::atomic_size_t arrived(0);
+    pool.AddTask(std::make_shared<BarrierTask>(arrived, 2));
+    pool.AddTask(std::make_shared<BarrierTask>(arrived, 2));
+    while (arrived < 2)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    pool.AddTask(std::make_shared<BlockingTask>(mutex, cv, release, blocked), ThreadPool::NORMAL, 0);
+    while (0 == blocked)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (size_t i = 0; i < TASKS; ++i)
+    {
+        pool.AddTask(std::make_shared<ThreadIdTask>(stolen, done), ThreadPool::NORMAL, 0);
+    }
+    while (done < TASKS - THRESHOLD)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        release = true;
+    }
+    cv.notify_all();
+
+    // the drain covers tasks still waiting in slots
+    if (false == pool.Shutdown(ThreadPool::SHUTDOWN_DRAIN, std::chrono::seconds(10)) || TASKS != done)
+    {
+        throw Error("Affinity tasks were lost on drain", Str(TASKS), Str(done), __LINE__);
+    }
+    }
+
+    std::cout << GREEN << "Pool passed affinity tests" << RESET << std::endl;
+}
+
+
+
+
 int main()
 {
+    try
+    {
+        TestDeadlineScheduling();
+        TestWorkerContexts();
+        TestReactor();
+        TestAsyncFileIO(AsyncFileIO::AUTO_BACKEND);
+        TestAsyncFileIO(AsyncFileIO::BLOCKING_BACKEND);
+        TestPipeline(1);
+        TestPipeline(4);
+        TestRecording();
+        TestSharedMemoryQueue();
+        TestBlockingScope();
+        TestWhenAllAny();
+        TestYieldIfNeeded();
+        TestTaskStats();
+        TestLifecycle();
+        TestIngress(ThreadPool::QUEUE_WAIT);
+        TestIngress(ThreadPool::REACTOR_WAIT);
+        TestAutoSizing();
+        TestBasicThreadPool();
+        TestAffinity();
+    }
+    catch(Error &e)
+    {
+        e.Display();
+        return -1;
+    }
+
     const size_t TESTS = 100; // set here the number of loop you want to go through that test 
     for (size_t testNum = 0; testNum < TESTS; ++testNum)
     {
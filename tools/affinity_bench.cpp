@@ -0,0 +1,297 @@
+// Partitioned hash-table workload run twice on the same pool configuration:
+// once with plain AddTask, once with the partition as affinity key. Reports
+// wall time and, where perf_event_open is permitted, last-level cache misses
+// of the whole process (workers included).
+//
+//	 affinity_bench [--threads N] [--partitions P] [--table-kb K] [--rounds R]
+//					[--lookups L] [--threshold T]
+
+#include <atomic>			  //	std::atomic_size_t, std::atomic
+#include <cerrno>			  //	errno
+#include <cstdint>			  //	uint64_t
+#include <cstdlib>			  //	std::atoi
+#include <cstring>			  //	std::strcmp, std::strerror, memset
+#include <iomanip>			  //	std::setw
+#include <iostream>			  //	std::cout
+#include <string>			  //	std::string
+#include <thread>			  //	std::this_thread
+#include <vector>			  //	std::vector
+
+#include <linux/perf_event.h> //	perf_event_attr
+#include <sys/ioctl.h>		  //	ioctl
+#include <sys/syscall.h>	  //	SYS_perf_event_open
+#include <unistd.h>			  //	syscall, read, close
+
+#include "thread_pool.hpp"
+
+using namespace levi;
+
+typedef ThreadPool::Clock Clock;
+
+// open-addressed table of one partition, sized to stay in one core's L2.
+// Filled once and only read afterwards, so rounds of one partition may run
+// concurrently (shared mode, stealing) without a lock
+class Partition
+{
+public:
+	explicit Partition(std::size_t bytes_) : m_slots(bytes_ / sizeof(uint64_t))
+	{
+		for (uint64_t key = 1; key <= Keys(); ++key)
+		{
+			m_slots[Probe(key)] = (key << 16) | (key & 0xFFFF);
+		}
+	}
+
+	uint64_t Lookup(uint64_t key_) const
+	{
+		return m_slots[Probe(key_)] & 0xFFFF;
+	}
+
+	// half the slots, so every probe ends at its key or an empty slot
+	uint64_t Keys() const
+	{
+		return m_slots.size() / 2;
+	}
+
+private:
+	std::vector<uint64_t> m_slots;
+
+	std::size_t Probe(uint64_t key_) const
+	{
+		std::size_t mask = m_slots.size() - 1;
+		std::size_t slot = static_cast<std::size_t>(key_ * 0x9E3779B97F4A7C15ULL) & mask;
+		while (0 != m_slots[slot] && key_ != (m_slots[slot] >> 16))
+		{
+			slot = (slot + 1) & mask;
+		}
+
+		return slot;
+	}
+};
+
+class LookupTask : public ThreadPool::ITask
+{
+public:
+	LookupTask(const Partition &partition_, uint64_t seed_, std::size_t lookups_, std::atomic_size_t &done_,
+			   std::atomic<uint64_t> &checksum_) :
+		m_partition(partition_), m_seed(seed_), m_lookups(lookups_), m_done(done_), m_checksum(checksum_) {}
+
+	virtual void Execute()
+	{
+		// keys repeat within a partition, so a warm cache serves most lookups;
+		// the sum stays task-local until the end
+		uint64_t state = m_seed;
+		uint64_t sum = 0;
+		for (std::size_t i = 0; i < m_lookups; ++i)
+		{
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			sum += m_partition.Lookup(1 + (state >> 33) % m_partition.Keys());
+		}
+		m_checksum += sum;
+		++m_done;
+	}
+
+private:
+	const Partition &m_partition;
+	uint64_t m_seed;
+	std::size_t m_lookups;
+	std::atomic_size_t &m_done;
+	std::atomic<uint64_t> &m_checksum;
+};
+
+// process-wide LLC miss counter, inherited by threads created after it
+class CacheMissCounter
+{
+public:
+	CacheMissCounter() : m_fd(-1), m_error(0)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		if (-1 == m_fd)
+		{
+			m_error = errno;
+			return;
+		}
+		ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	~CacheMissCounter()
+	{
+		if (-1 != m_fd)
+		{
+			close(m_fd);
+		}
+	}
+
+	CacheMissCounter(const CacheMissCounter &other_) = delete;
+	CacheMissCounter &operator=(const CacheMissCounter &other_) = delete;
+
+	// counts of exited threads are folded in, so read after the pool is gone
+	std::string Read() const
+	{
+		uint64_t count = 0;
+		if (-1 == m_fd)
+		{
+			return std::string("n/a (") + std::strerror(m_error) + ")";
+		}
+		if (static_cast<ssize_t>(sizeof(count)) != read(m_fd, &count, sizeof(count)))
+		{
+			return "n/a";
+		}
+
+		return std::to_string(count);
+	}
+
+private:
+	int m_fd;
+	int m_error;
+};
+
+struct Config
+{
+	std::size_t threads;
+	std::size_t partitions;
+	std::size_t table_bytes;
+	std::size_t rounds;
+	std::size_t lookups;
+	std::size_t threshold;
+};
+
+static void Run(const Config &config_, bool affinity_)
+{
+	std::vector<Partition *> partitions;
+	for (std::size_t i = 0; i < config_.partitions; ++i)
+	{
+		partitions.push_back(new Partition(config_.table_bytes));
+	}
+
+	std::atomic_size_t done(0);
+	std::atomic<uint64_t> checksum(0);
+	std::size_t tasks = config_.rounds * config_.partitions;
+	double seconds = 0;
+	CacheMissCounter misses;
+	{
+	ThreadPool pool(config_.threads);
+	pool.SetAffinityStealThreshold(config_.threshold);
+
+	Clock::time_point start = Clock::now();
+	for (std::size_t round = 0; round < config_.rounds; ++round)
+	{
+		for (std::size_t i = 0; i < config_.partitions; ++i)
+		{
+			std::shared_ptr<ThreadPool::ITask> lookup = std::make_shared<LookupTask>(
+				*partitions[i], round * config_.partitions + i, config_.lookups, done, checksum);
+			if (affinity_)
+			{
+				pool.AddTask(lookup, ThreadPool::NORMAL, i);
+			}
+			else
+			{
+				pool.AddTask(lookup, ThreadPool::NORMAL);
+			}
+		}
+	}
+	while (done < tasks)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	std::cout << std::setw(12) << (affinity_ ? "affinity" : "shared") << std::setw(12) << seconds * 1000
+			  << std::setw(14) << tasks / seconds << "  " << misses.Read() << std::endl;
+
+	for (Partition *partition : partitions)
+	{
+		delete partition;
+	}
+}
+
+static void Usage()
+{
+	std::cerr << "usage: affinity_bench [--threads N] [--partitions P] [--table-kb K] [--rounds R]"
+			  << " [--lookups L] [--threshold T]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	Config config;
+	config.threads = std::thread::hardware_concurrency();
+	config.partitions = 0;
+	config.table_bytes = 256 * 1024;
+	config.rounds = 200;
+	config.lookups = 20000;
+	config.threshold = ThreadPool::DEFAULT_AFFINITY_STEAL_THRESHOLD;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::size_t value = (i + 1 < argc) ? static_cast<std::size_t>(std::atoi(argv[i + 1])) : 0;
+		if (0 == std::strcmp(argv[i], "--threads") && i + 1 < argc)
+		{
+			config.threads = value;
+		}
+		else if (0 == std::strcmp(argv[i], "--partitions") && i + 1 < argc)
+		{
+			config.partitions = value;
+		}
+		else if (0 == std::strcmp(argv[i], "--table-kb") && i + 1 < argc)
+		{
+			config.table_bytes = value * 1024;
+		}
+		else if (0 == std::strcmp(argv[i], "--rounds") && i + 1 < argc)
+		{
+			config.rounds = value;
+		}
+		else if (0 == std::strcmp(argv[i], "--lookups") && i + 1 < argc)
+		{
+			config.lookups = value;
+		}
+		else if (0 == std::strcmp(argv[i], "--threshold") && i + 1 < argc)
+		{
+			config.threshold = value;
+		}
+		else
+		{
+			Usage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (0 == config.threads)
+	{
+		config.threads = 1;
+	}
+	if (0 == config.partitions)
+	{
+		config.partitions = config.threads;
+	}
+	// Partition::Probe masks by the slot count, keep it a power of two
+	std::size_t table = 1024;
+	while (table < config.table_bytes)
+	{
+		table <<= 1;
+	}
+	config.table_bytes = table;
+
+	std::cout << config.threads << " workers, " << config.partitions << " partitions of "
+			  << config.table_bytes / 1024 << " KB, " << config.rounds << " rounds of " << config.lookups
+			  << " lookups" << std::endl;
+	std::cout << std::setw(12) << "submit" << std::setw(12) << "wall ms" << std::setw(14) << "tasks/s"
+			  << "  LLC misses" << std::endl;
+
+	Run(config, false);
+	Run(config, true);
+
+	return 0;
+}
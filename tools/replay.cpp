@@ -0,0 +1,325 @@
+// Replays a ThreadPool recording (ThreadPool::StartRecording) against a pool
+// configuration of choice, using synthetic tasks that spin for the recorded
+// Execute durations, and reports throughput and latency percentiles.
+//
+//	 replay <recording> [--threads N] [--queue pool|fifo|priority]
+//			[--wait queue|reactor|spin] [--fairness priority|edf|none] [--speed X]
+//
+// --queue pool is ThreadPool, fifo and priority are BasicThreadPools with
+// that queue policy. --wait reactor needs the pool queue, spin a
+// BasicThreadPool. --fairness edf (pool queue only) gives every task the
+// deadline submit + recorded duration and runs late ones anyway, none
+// submits all at NORMAL.
+
+#include <algorithm>		  //	std::sort, std::stable_sort
+#include <atomic>			  //	std::atomic_size_t
+#include <cstdlib>			  //	std::atoi, std::atof
+#include <cstring>			  //	std::strcmp
+#include <iostream>			  //	std::cout
+#include <map>				  //	std::map
+#include <string>			  //	std::string
+#include <thread>			  //	std::thread
+#include <vector>			  //	std::vector
+
+#include "thread_pool.hpp"
+#include "basic_thread_pool.hpp"
+#include "task_recorder.hpp"
+
+using namespace levi;
+
+typedef ThreadPool::Clock Clock;
+
+struct Timing
+{
+	Clock::time_point submit;
+	Clock::time_point start;
+	Clock::time_point end;
+};
+
+class SpinTask : public ThreadPool::ITask
+{
+public:
+	SpinTask(Clock::duration duration_, Timing &timing_, std::atomic_size_t &done_) :
+		m_duration(duration_), m_timing(timing_), m_done(done_) {}
+
+	virtual void Execute()
+	{
+		m_timing.start = Clock::now();
+		while (Clock::now() - m_timing.start < m_duration)
+		{
+			// burn the recorded CPU time
+		}
+		m_timing.end = Clock::now();
+		++m_done;
+	}
+
+private:
+	Clock::duration m_duration;
+	Timing &m_timing;
+	std::atomic_size_t &m_done;
+};
+
+static double Percentile(std::vector<double> &sorted_, double p_)
+{
+	if (sorted_.empty())
+	{
+		return 0;
+	}
+
+	std::size_t index = static_cast<std::size_t>(p_ * (sorted_.size() - 1));
+	return sorted_[index];
+}
+
+static void Report(const char *name_, std::vector<double> values_)
+{
+	std::sort(values_.begin(), values_.end());
+
+	std::cout << name_ << " (us): p50 " << Percentile(values_, 0.5) << ", p90 " << Percentile(values_, 0.9)
+			  << ", p99 " << Percentile(values_, 0.99) << ", p99.9 " << Percentile(values_, 0.999)
+			  << ", max " << Percentile(values_, 1.0) << std::endl;
+}
+
+static void Usage()
+{
+	std::cout << "usage: replay <recording> [--threads N] [--queue pool|fifo|priority]\n"
+			  << "              [--wait queue|reactor|spin] [--fairness priority|edf|none] [--speed X]" << std::endl;
+}
+
+enum Fairness
+{
+	STRICT_PRIORITY,
+	EARLIEST_DEADLINE,
+	NO_PRIORITY
+};
+
+struct Workload
+{
+	std::vector<TaskRecord> records;
+	// record indexes of each recorded producer, by submit time
+	std::map<uint32_t, std::vector<std::size_t>> producers;
+	std::vector<Timing> timings;
+	std::atomic_size_t done;
+	Clock::time_point begin;
+	double speed;
+	Fairness fairness;
+	std::size_t deadline_misses;
+};
+
+// Re-issues every record at its recorded time, one submitting thread per
+// recorded producer to keep submission contention, and waits until all ran.
+// add_(index, task, priority) hands one task to the pool under test
+template <typename ADD>
+static void Submit(Workload &workload_, ADD add_)
+{
+	workload_.begin = Clock::now() + std::chrono::milliseconds(10);
+
+	std::vector<std::thread> submitters;
+	for (const auto &producer : workload_.producers)
+	{
+		const std::vector<std::size_t> &indexes = producer.second;
+		submitters.push_back(std::thread([&workload_, &add_, &indexes]()
+		{
+			for (std::size_t index : indexes)
+			{
+				const TaskRecord &record = workload_.records[index];
+				Clock::time_point at = workload_.begin + std::chrono::nanoseconds(
+					static_cast<uint64_t>(record.submit_ns / workload_.speed));
+				std::this_thread::sleep_until(at);
+
+				Timing &timing = workload_.timings[index];
+				timing.submit = Clock::now();
+				ThreadPool::Priority priority = (NO_PRIORITY == workload_.fairness) ?
+					ThreadPool::NORMAL : static_cast<ThreadPool::Priority>(record.priority);
+				add_(index, std::make_shared<SpinTask>(std::chrono::nanoseconds(record.duration_ns),
+													   timing, workload_.done), priority);
+			}
+		}));
+	}
+
+	for (std::thread &submitter : submitters)
+	{
+		submitter.join();
+	}
+	while (workload_.done < workload_.records.size())
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+static void ReplayThreadPool(Workload &workload_, std::size_t threads_, ThreadPool::WaitMode wait_)
+{
+	bool edf = (EARLIEST_DEADLINE == workload_.fairness);
+	ThreadPool pool(threads_, edf ? ThreadPool::EDF_MODE : ThreadPool::PRIORITY_MODE, wait_);
+	// late tasks still run, their latency is what is measured
+	pool.SetDeadlineMissHandler([](std::shared_ptr<ThreadPool::ITask> task_) { task_->Execute(); });
+
+	Submit(workload_, [&pool, &workload_, edf](std::size_t index_, std::shared_ptr<SpinTask> task_,
+											   ThreadPool::Priority priority_)
+	{
+		if (edf)
+		{
+			Clock::time_point deadline = workload_.timings[index_].submit +
+				std::chrono::nanoseconds(workload_.records[index_].duration_ns);
+			pool.AddTask(task_, deadline, priority_);
+		}
+		else
+		{
+			pool.AddTask(task_, priority_);
+		}
+	});
+
+	workload_.deadline_misses = pool.GetDeadlineMisses();
+}
+
+template <typename POOL>
+static void ReplayBasicPool(Workload &workload_, std::size_t threads_)
+{
+	POOL pool(threads_);
+
+	Submit(workload_, [&pool](std::size_t, std::shared_ptr<SpinTask> task_, ThreadPool::Priority priority_)
+	{
+		pool.AddTask(task_, priority_);
+	});
+}
+
+// BasicThreadPool over the VirtualTask policy, so SpinTasks run unchanged
+template <template <typename> class QueuePolicy>
+static void ReplayBasicPool(Workload &workload_, std::size_t threads_, bool spin_)
+{
+	using namespace pool_policy;
+	if (spin_)
+	{
+		ReplayBasicPool<BasicThreadPool<QueuePolicy, SpinThenBlockWait<>, VirtualTask>>(workload_, threads_);
+	}
+	else
+	{
+		ReplayBasicPool<BasicThreadPool<QueuePolicy, BlockingWait, VirtualTask>>(workload_, threads_);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		Usage();
+		return 1;
+	}
+
+	std::size_t threads = std::thread::hardware_concurrency();
+	std::string queue = "pool";
+	std::string wait = "queue";
+	std::string fairness = "priority";
+	double speed = 1.0;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		if (0 == std::strcmp(argv[i], "--threads") && i + 1 < argc)
+		{
+			threads = static_cast<std::size_t>(std::atoi(argv[++i]));
+		}
+		else if (0 == std::strcmp(argv[i], "--queue") && i + 1 < argc)
+		{
+			queue = argv[++i];
+		}
+		else if (0 == std::strcmp(argv[i], "--wait") && i + 1 < argc)
+		{
+			wait = argv[++i];
+		}
+		else if (0 == std::strcmp(argv[i], "--fairness") && i + 1 < argc)
+		{
+			fairness = argv[++i];
+		}
+		else if (0 == std::strcmp(argv[i], "--speed") && i + 1 < argc)
+		{
+			speed = std::atof(argv[++i]);
+		}
+		else
+		{
+			Usage();
+			return 1;
+		}
+	}
+
+	bool pool_queue = ("pool" == queue);
+	bool valid = (pool_queue || "fifo" == queue || "priority" == queue) &&
+				 ("queue" == wait || ("reactor" == wait && pool_queue) || ("spin" == wait && !pool_queue)) &&
+				 ("priority" == fairness || ("edf" == fairness && pool_queue) || "none" == fairness);
+	if (false == valid)
+	{
+		Usage();
+		return 1;
+	}
+
+	Workload workload;
+	if (false == TaskRecorder::Load(argv[1], workload.records) || 0 == threads || speed <= 0)
+	{
+		std::cout << "cannot replay " << argv[1] << std::endl;
+		return 1;
+	}
+	workload.timings.resize(workload.records.size());
+	workload.done = 0;
+	workload.deadline_misses = 0;
+	workload.speed = speed;
+	workload.fairness = ("edf" == fairness) ? EARLIEST_DEADLINE :
+						("none" == fairness) ? NO_PRIORITY : STRICT_PRIORITY;
+
+	// tasks that never ran still load the queue, they replay with no duration
+	const std::vector<TaskRecord> &records = workload.records;
+	std::size_t never_ran = 0;
+	for (std::size_t i = 0; i < records.size(); ++i)
+	{
+		workload.producers[records[i].producer].push_back(i);
+		never_ran += (0 == records[i].completed);
+	}
+	// submit order is not guaranteed by the file layout; unsorted,
+	// sleep_until would fire in bursts
+	for (auto &producer : workload.producers)
+	{
+		std::stable_sort(producer.second.begin(), producer.second.end(),
+						 [&records](std::size_t i1_, std::size_t i2_)
+						 { return records[i1_].submit_ns < records[i2_].submit_ns; });
+	}
+
+	if (pool_queue)
+	{
+		ReplayThreadPool(workload, threads, ("reactor" == wait) ? ThreadPool::REACTOR_WAIT : ThreadPool::QUEUE_WAIT);
+	}
+	else if ("fifo" == queue)
+	{
+		ReplayBasicPool<pool_policy::FifoQueue>(workload, threads, "spin" == wait);
+	}
+	else
+	{
+		ReplayBasicPool<pool_policy::PriorityQueue>(workload, threads, "spin" == wait);
+	}
+
+	std::vector<double> latency;
+	std::vector<double> queue_wait;
+	Clock::time_point last = workload.begin;
+	for (const Timing &timing : workload.timings)
+	{
+		using namespace std::chrono;
+		latency.push_back(duration_cast<nanoseconds>(timing.end - timing.submit).count() / 1000.0);
+		queue_wait.push_back(duration_cast<nanoseconds>(timing.start - timing.submit).count() / 1000.0);
+		last = std::max(last, timing.end);
+	}
+
+	double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(last - workload.begin).count() / 1e9;
+
+	std::cout << "tasks " << records.size() << ", producers " << workload.producers.size() << ", threads " << threads
+			  << ", queue " << queue << ", wait " << wait << ", fairness " << fairness << ", speed " << speed << std::endl;
+	if (0 != never_ran)
+	{
+		std::cout << "never ran when recorded: " << never_ran << std::endl;
+	}
+	std::cout << "throughput: " << (seconds > 0 ? records.size() / seconds : 0) << " tasks/s over "
+			  << seconds << " s" << std::endl;
+	if (EARLIEST_DEADLINE == workload.fairness)
+	{
+		std::cout << "deadline misses: " << workload.deadline_misses << std::endl;
+	}
+	Report("latency", latency);
+	Report("queue wait", queue_wait);
+
+	return 0;
+}